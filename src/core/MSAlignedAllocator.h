@@ -0,0 +1,94 @@
+// Copyright (C) 2016 Matteo Agostini <matteo.agostini@ph.tum.de>
+
+// This is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+/*!
+ * \class mst::MSAlignedAllocator
+ *
+ * \brief 
+ * STL allocator returning memory aligned to a cache line
+ *
+ * \details 
+ * Minimal allocator used for the contiguous arrays evaluated in the hot loops
+ * of the likelihood functions. The alignment allows the compiler to use
+ * aligned vector loads and guarantees that rows of a matrix do not share
+ * cache lines when their length is padded to MSAlignedAllocator::kPadding.
+ *
+ * \author Matteo Agostini
+ */
+
+#ifndef MST_MSAlignedAllocator_H
+#define MST_MSAlignedAllocator_H
+
+// c/c++ libs
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+namespace mst {
+
+template <typename T, std::size_t Alignment = 64>
+class MSAlignedAllocator
+{
+   public:
+      using value_type = T;
+      //! Number of elements of type T filling one aligned block
+      static constexpr std::size_t kPadding = 
+         Alignment/sizeof(T) > 0 ? Alignment/sizeof(T) : 1;
+
+      template <typename U> struct rebind {
+         using other = MSAlignedAllocator<U, Alignment>;
+      };
+
+      //! Constructor
+      MSAlignedAllocator() {}
+      //! Copy constructor from allocators of other types
+      template <typename U> 
+      MSAlignedAllocator(const MSAlignedAllocator<U, Alignment>&) {}
+
+      //! Allocate aligned memory for n objects
+      T* allocate(std::size_t n) {
+         void* ptr = nullptr;
+         if (n == 0) return nullptr;
+         if (posix_memalign(&ptr, Alignment, n*sizeof(T)) != 0) 
+            throw std::bad_alloc();
+         return static_cast<T*>(ptr);
+      }
+      //! Release memory
+      void deallocate(T* ptr, std::size_t) { free(ptr); }
+
+      //! Round n up to a multiple of kPadding
+      static std::size_t Pad(std::size_t n) {
+         return (n + kPadding - 1) / kPadding * kPadding;
+      }
+};
+
+template <typename T, typename U, std::size_t A>
+bool operator== (const MSAlignedAllocator<T,A>&, const MSAlignedAllocator<U,A>&) {
+   return true;
+}
+template <typename T, typename U, std::size_t A>
+bool operator!= (const MSAlignedAllocator<T,A>&, const MSAlignedAllocator<U,A>&) {
+   return false;
+}
+
+//! Vector with storage aligned to a cache line
+template <typename T>
+using MSAlignedVector = std::vector<T, MSAlignedAllocator<T>>;
+
+} // namespace mst
+
+#endif // MST_MSAlignedAllocator_H
@@ -0,0 +1,215 @@
+// Copyright (C) 2016 Matteo Agostini <matteo.agostini@ph.tum.de>
+
+// This is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+// c/c++ libs
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+// m-stats libs
+#include "MSLBFGSB.h"
+
+namespace mst {
+
+namespace {
+// Sufficient decrease parameter of the Armijo condition
+constexpr double kArmijo = 1e-4;
+// Maximum number of backtracking steps of the line search
+constexpr int kMaxBacktracking = 40;
+} // anonymous namespace
+
+int MSLBFGSB::Minimize(const MSObjective& fcn, std::vector<double>& x,
+                       const std::vector<double>& lower,
+                       const std::vector<double>& upper,
+                       const std::vector<double>& scale)
+{
+   const std::size_t n = x.size();
+   if (lower.size() != n || upper.size() != n || scale.size() != n) {
+      std::cerr << "MSLBFGSB::Minimize: inconsistent size of the bounds"
+                << std::endl;
+      exit(1);
+   }
+
+   fS.clear();
+   fY.clear();
+   fGamma = 1.0;
+   fH0.resize(n);
+   for (std::size_t i = 0; i < n; i++)
+      fH0[i] = scale[i] > 0 ? scale[i]*scale[i] : 1.0;
+   fFree.assign(n, true);
+   fNCalls = 0;
+   fNIterations = 0;
+
+   auto Project = [&] (std::vector<double>& v) {
+      for (std::size_t i = 0; i < n; i++)
+         v[i] = std::min(std::max(v[i], lower[i]), upper[i]);
+   };
+
+   Project(x);
+   std::vector<double> g(n), q(n), d(n), xt(n), gt(n), s(n), y(n);
+   double f = fcn(x.data(), g.data());
+   fNCalls++;
+
+   const double edmMax = 0.001*fTolerance*fErrorDef;
+   int status = 4;
+   while (fNCalls < fMaxCalls) {
+      // Parameters on a bound with the gradient pointing outwards are kept
+      // fixed during this iteration
+      for (std::size_t i = 0; i < n; i++) {
+         fFree[i] = lower[i] < upper[i] &&
+                    !(x[i] <= lower[i] && g[i] > 0) &&
+                    !(x[i] >= upper[i] && g[i] < 0);
+         q[i] = fFree[i] ? g[i] : 0.0;
+      }
+
+      // Quasi-Newton direction and estimated distance from the minimum
+      ComputeDirection(q, d);
+      double qd = 0.0;
+      for (std::size_t i = 0; i < n; i++) qd += q[i]*d[i];
+      fEDM = -0.5*qd;
+      if (qd == 0.0 || (!fS.empty() && fEDM < edmMax)) {
+         status = 0;
+         break;
+      }
+      // Restart from the scaled steepest descent if the direction is not
+      // downhill (e.g. corrections spoiled by a change of the active set)
+      if (!(qd < 0)) {
+         fS.clear(); fY.clear();
+         fGamma = 1.0;
+         ComputeDirection(q, d);
+      }
+
+      // Backtracking line search along the projected path
+      double alpha = 1.0, ft = 0.0;
+      bool accepted = false;
+      for (int ls = 0; ls < kMaxBacktracking && fNCalls < fMaxCalls; ls++) {
+         for (std::size_t i = 0; i < n; i++) xt[i] = x[i] + alpha*d[i];
+         Project(xt);
+         double decrease = 0.0;
+         bool moved = false;
+         for (std::size_t i = 0; i < n; i++) {
+            decrease += g[i]*(xt[i] - x[i]);
+            if (xt[i] != x[i]) moved = true;
+         }
+         if (!moved) break;
+         ft = fcn(xt.data(), gt.data());
+         fNCalls++;
+         if (std::isfinite(ft) && ft <= f + kArmijo*decrease) {
+            accepted = true;
+            break;
+         }
+         // Minimum of the quadratic interpolation, kept within [0.1,0.5]*alpha
+         const double den = 2.0*(ft - f - decrease);
+         double alphaNew = 0.5*alpha;
+         if (std::isfinite(ft) && den > 0) alphaNew = -decrease*alpha/den;
+         alpha = std::min(std::max(alphaNew, 0.1*alpha), 0.5*alpha);
+      }
+
+      if (!accepted) {
+         // No decrease within the numerical precision close to the minimum.
+         // Otherwise retry once from the steepest descent
+         if (fEDM < edmMax) { status = 0; break; }
+         if (fS.empty()) break;
+         fS.clear(); fY.clear();
+         fGamma = 1.0;
+         continue;
+      }
+
+      // Update the corrections. Pairs with non-positive curvature are skipped
+      // to keep the approximated Hessian positive definite
+      double sy = 0.0, yy = 0.0, yHy = 0.0;
+      for (std::size_t i = 0; i < n; i++) {
+         s[i] = xt[i] - x[i];
+         y[i] = gt[i] - g[i];
+         sy  += s[i]*y[i];
+         yy  += y[i]*y[i];
+         yHy += y[i]*fH0[i]*y[i];
+      }
+      if (sy > 1e-12*yy && yHy > 0) {
+         if (fS.size() == fMemory) {
+            fS.erase(fS.begin());
+            fY.erase(fY.begin());
+         }
+         fS.push_back(s);
+         fY.push_back(y);
+         fGamma = sy/yHy;
+      }
+
+      const double fPrevious = f;
+      x.swap(xt);
+      g.swap(gt);
+      f = ft;
+      fNIterations++;
+
+      // Stop if the function does not change within the numerical precision
+      if (fPrevious - f <= 1e-15*std::max(std::fabs(f), 1.0) && !fS.empty() &&
+          fEDM < 1e3*edmMax) {
+         status = 0;
+         break;
+      }
+   }
+   fMinFCN = f;
+
+   // Diagonal of the approximated inverse Hessian at the minimum
+   fInvHessDiag.assign(n, 0.0);
+   for (std::size_t i = 0; i < n; i++) {
+      if (!fFree[i]) continue;
+      std::fill(q.begin(), q.end(), 0.0);
+      q[i] = 1.0;
+      ComputeDirection(q, d);
+      fInvHessDiag[i] = -d[i];
+   }
+
+   return status;
+}
+
+void MSLBFGSB::ComputeDirection(const std::vector<double>& q, std::vector<double>& d)
+{
+   const std::size_t n = q.size();
+   const std::size_t m = fS.size();
+
+   // Two-loop recursion. The corrections are projected on the free parameters
+   // and skipped if the projected curvature is not positive
+   std::vector<double> alpha(m, 0.0), rho(m, 0.0);
+   for (std::size_t i = 0; i < n; i++) d[i] = fFree[i] ? q[i] : 0.0;
+   for (std::size_t k = m; k-- > 0; ) {
+      double sy = 0.0, sd = 0.0;
+      for (std::size_t i = 0; i < n; i++) {
+         if (!fFree[i]) continue;
+         sy += fS[k][i]*fY[k][i];
+         sd += fS[k][i]*d[i];
+      }
+      if (!(sy > 0)) continue;
+      rho[k] = 1.0/sy;
+      alpha[k] = rho[k]*sd;
+      for (std::size_t i = 0; i < n; i++)
+         if (fFree[i]) d[i] -= alpha[k]*fY[k][i];
+   }
+   for (std::size_t i = 0; i < n; i++) d[i] *= fGamma*fH0[i];
+   for (std::size_t k = 0; k < m; k++) {
+      if (rho[k] == 0.0) continue;
+      double yd = 0.0;
+      for (std::size_t i = 0; i < n; i++)
+         if (fFree[i]) yd += fY[k][i]*d[i];
+      const double beta = rho[k]*yd;
+      for (std::size_t i = 0; i < n; i++)
+         if (fFree[i]) d[i] += (alpha[k] - beta)*fS[k][i];
+   }
+   for (std::size_t i = 0; i < n; i++) d[i] = fFree[i] ? -d[i] : 0.0;
+}
+
+} // namespace mst
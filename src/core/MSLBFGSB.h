@@ -0,0 +1,131 @@
+// Copyright (C) 2016 Matteo Agostini <matteo.agostini@ph.tum.de>
+
+// This is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+/*!
+ * \class mst::MSLBFGSB
+ *
+ * \brief
+ * Limited-memory BFGS minimizer with box constraints
+ *
+ * \details
+ * Quasi-Newton minimizer working directly on the bounded parameters, without
+ * the sine transformation used by minuit. At each iteration the parameters
+ * sitting on a bound with the gradient pointing outwards are kept fixed, the
+ * search direction of the others is computed with the L-BFGS two-loop
+ * recursion and the step is found by a backtracking line search along the
+ * path projected on the box (Armijo condition).
+ *
+ * The initial inverse Hessian is diag(scale^2), i.e. the scales are expected
+ * to be of the order of the parameter uncertainties (e.g. minuit start
+ * steps). Fixed parameters are defined by equal lower and upper bounds.
+ *
+ * As for MIGRAD, the minimization stops when the estimated vertical distance
+ * to the minimum (EDM) is below 0.001*tolerance*errorDef.
+ *
+ * \author Matteo Agostini
+ */
+
+#ifndef MST_MSLBFGSB_H
+#define MST_MSLBFGSB_H
+
+// c/c++ libs
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+namespace mst {
+
+class MSLBFGSB
+{
+   public:
+      //! Function returning the value at x and filling the gradient grad
+      using MSObjective = std::function<double(const double* x, double* grad)>;
+
+   public:
+      //! Constructor. The number of corrections kept in memory is m
+      MSLBFGSB(unsigned int m = 8) : fMemory(m) {}
+      //! Destructor
+      virtual ~MSLBFGSB() {}
+
+      //! Set the maximum number of evaluations of the objective function
+      void SetMaxCalls(int maxCalls) { fMaxCalls = maxCalls; }
+      //! Set the tolerance (same convention as MIGRAD)
+      void SetTolerance(double tolerance) { fTolerance = tolerance; }
+      //! Set the error definition (0.5 for NLL, 1 for chi^2)
+      void SetErrorDef(double errorDef) { fErrorDef = errorDef; }
+
+      //! Minimize the function starting from x, which is updated with the
+      //! position of the minimum. Return 0 if converged, 4 otherwise
+      int Minimize(const MSObjective& fcn, std::vector<double>& x,
+                   const std::vector<double>& lower,
+                   const std::vector<double>& upper,
+                   const std::vector<double>& scale);
+
+      //! Get the function value at the minimum (synced with last Minimize call)
+      double GetMinFCN() const { return fMinFCN; }
+      //! Get the estimated vertical distance from the minimum
+      double GetEDM() const { return fEDM; }
+      //! Get the number of evaluations of the objective function
+      int GetNCalls() const { return fNCalls; }
+      //! Get the number of iterations
+      int GetNIterations() const { return fNIterations; }
+
+      //! Get the diagonal of the inverse Hessian approximated by the
+      //! corrections kept in memory at the minimum (null for the parameters
+      //! on a bound)
+      const std::vector<double>& GetInverseHessianDiagonal() const { return fInvHessDiag; }
+
+   private:
+      //! Compute d = -H*q with the corrections in memory, restricted to the
+      //! parameters free to move (the other entries of d are null)
+      void ComputeDirection(const std::vector<double>& q, std::vector<double>& d);
+
+   private:
+      //! Number of corrections kept in memory
+      std::size_t fMemory {8};
+      //! Maximum number of evaluations of the objective function
+      int fMaxCalls {2000};
+      //! Tolerance
+      double fTolerance {0.1};
+      //! Error definition
+      double fErrorDef {0.5};
+
+      //! Function value at the minimum
+      double fMinFCN {0.0};
+      //! Estimated vertical distance from the minimum
+      double fEDM {0.0};
+      //! Number of evaluations of the objective function
+      int fNCalls {0};
+      //! Number of iterations
+      int fNIterations {0};
+
+      //! Diagonal of the initial inverse Hessian (scale^2)
+      std::vector<double> fH0;
+      //! Scaling factor of the initial inverse Hessian
+      double fGamma {1.0};
+      //! Flag of the parameters free to move at the current iteration
+      std::vector<bool> fFree;
+      //! Steps s = x_{k+1}-x_k kept in memory
+      std::vector<std::vector<double>> fS;
+      //! Gradient differences y = g_{k+1}-g_k kept in memory
+      std::vector<std::vector<double>> fY;
+      //! Diagonal of the inverse Hessian at the minimum
+      std::vector<double> fInvHessDiag;
+};
+
+} // namespace mst
+
+#endif // MST_MSLBFGSB_H
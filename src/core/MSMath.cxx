@@ -15,6 +15,9 @@
 // Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 
 // c++ libs
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
 #include <limits>
 #include <cmath>
@@ -26,6 +29,25 @@
 // m-stats libs
 #include "MSMath.h"
 
+// Compiler attributes used to build the same kernel for different instruction
+// sets. The kernels are selected at runtime (see GetKernels) on x86 CPUs
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define MST_SIMD_DISPATCH 1
+#  if defined(__clang__)
+#     define MST_TARGET(isa) __attribute__((target(isa)))
+#  else
+#     define MST_TARGET(isa) __attribute__((target(isa), optimize("tree-vectorize")))
+#  endif
+#else
+#  define MST_SIMD_DISPATCH 0
+#endif
+
+#if defined(__GNUC__)
+#  define MST_INLINE inline __attribute__((always_inline))
+#else
+#  define MST_INLINE inline
+#endif
+
 namespace mst {
 
 double MSMath::LogGaus(double x, double mean, double sigma) {
@@ -106,4 +128,238 @@ double MSMath::LogExp (double x, double limit, double quantile, double offset) {
       return  log(a)-a*(x-offset);
    }
 }
+
+namespace {
+
+// Number of independent accumulators used by the kernels. The partial sums
+// are stored in an array that the compiler maps onto vector registers
+const std::size_t kLanes = 8;
+
+const double kInf = std::numeric_limits<double>::infinity();
+const double kLog2Pi = log(2*M_PI);
+
+// Branch-free natural logarithm for positive finite arguments. The argument
+// is decomposed as 2^e*m with m in [sqrt(1/2), sqrt(2)) and log(m) is
+// computed with the series 2*atanh(s) = log(m), s = (m-1)/(m+1), which 
+// converges to double precision in 12 terms for |s| < 0.172. Subnormal
+// arguments are rescaled into the normal range. The exponent is converted
+// into a double through the 2^52 magic number to avoid 64-bit integer to
+// double conversions that have no vector instruction before AVX-512DQ
+MST_INLINE double KernelLog(double x) {
+   const bool subnormal = x < std::numeric_limits<double>::min();
+   x = subnormal ? x * 18014398509481984.0 /* 2^54 */ : x;
+
+   uint64_t bits;
+   std::memcpy(&bits, &x, sizeof(bits));
+   const uint64_t mantissaBits = (bits & 0x000FFFFFFFFFFFFFULL) 
+                                 | 0x3FF0000000000000ULL;
+   const uint64_t exponentBits = (bits >> 52) | 0x4330000000000000ULL;
+   double m, e;
+   std::memcpy(&m, &mantissaBits, sizeof(m));
+   std::memcpy(&e, &exponentBits, sizeof(e));
+   e -= 4503599627370496.0 /* 2^52 */;
+   e -= subnormal ? 1077.0 : 1023.0;
+
+   const bool large = m > M_SQRT2;
+   m = large ? 0.5*m : m;
+   e = large ? e + 1.0 : e;
+
+   const double s = (m - 1.0) / (m + 1.0);
+   const double z = s*s;
+   double p = 1.0/23.0;
+   p = p*z + 1.0/21.0;
+   p = p*z + 1.0/19.0;
+   p = p*z + 1.0/17.0;
+   p = p*z + 1.0/15.0;
+   p = p*z + 1.0/13.0;
+   p = p*z + 1.0/11.0;
+   p = p*z + 1.0/9.0;
+   p = p*z + 1.0/7.0;
+   p = p*z + 1.0/5.0;
+   p = p*z + 1.0/3.0;
+   p = p*z + 1.0;
+   return e*M_LN2 + 2.0*s*p;
+}
+
+// Branch-free log(Gamma(x+1)) for x >= 0. Arguments below 8 are shifted by 8
+// with the recurrence Gamma(z+1) = z*Gamma(z) and the Stirling series is 
+// truncated after the z^-13 term (absolute accuracy ~1e-15 for z >= 8)
+MST_INLINE double KernelLnGamma1(double x) {
+   const double z = x + 1.0;
+   const bool shift = z < 8.0;
+   const double prod = shift ? z*(z+1.0)*(z+2.0)*(z+3.0)*(z+4.0)*(z+5.0)*(z+6.0)*(z+7.0)
+                             : 1.0;
+   const double zz = shift ? z + 8.0 : z;
+   const double r = 1.0/zz;
+   const double r2 = r*r;
+   double series = 1.0/156.0;
+   series = series*r2 - 691.0/360360.0;
+   series = series*r2 + 1.0/1188.0;
+   series = series*r2 - 1.0/1680.0;
+   series = series*r2 + 1.0/1260.0;
+   series = series*r2 - 1.0/360.0;
+   series = series*r2 + 1.0/12.0;
+   return (zz - 0.5)*KernelLog(zz) - zz + 0.5*kLog2Pi + series*r 
+          - KernelLog(prod);
+}
+
+// Element-wise kernels reproducing the scalar functions in MSMath
+MST_INLINE double KernelLogPoisson(double x, double lambda, double lnGamma1) {
+   // the log of lambda is shared by the Poisson and Gaussian approximation
+   const double logLambda = KernelLog(lambda);
+   const double logPoisson = x*logLambda - lambda - lnGamma1;
+   const double dx = x - lambda;
+   const double logGaus = -0.5*dx*dx/lambda - 0.5*kLog2Pi - 0.5*logLambda;
+
+   double result = lambda < 899 ? logPoisson : logGaus;
+   result = x == 0.0 ? -lambda : result;
+   result = lambda == 0.0 ? (x == 0.0 ? 0.0 : -kInf) : result;
+   return (lambda < 0.0 || x < 0.0) ? -kInf : result;
+}
+
+MST_INLINE double KernelLogPoisson(double x, double lambda) {
+   return KernelLogPoisson(x, lambda, KernelLnGamma1(x));
+}
+
+// Accumulate the kernels in kLanes independent partial sums (vectorized by
+// the compiler) and reduce them in a fixed order
+MST_INLINE double ImplSumLogPoisson(const double* x, const double* lambda, 
+                                    std::size_t n) {
+   double acc[kLanes] = {0};
+   std::size_t i = 0;
+   for (; i + kLanes <= n; i += kLanes)
+      for (std::size_t l = 0; l < kLanes; l++) 
+         acc[l] += KernelLogPoisson(x[i+l], lambda[i+l]);
+   for (; i < n; i++) acc[0] += KernelLogPoisson(x[i], lambda[i]);
+   double sum = 0.0;
+   for (std::size_t l = 0; l < kLanes; l++) sum += acc[l];
+   return sum;
+}
+
+MST_INLINE double ImplSumLogPoisson(const double* x, const double* lambda, 
+                                    const double* lnGamma1, std::size_t n) {
+   double acc[kLanes] = {0};
+   std::size_t i = 0;
+   for (; i + kLanes <= n; i += kLanes)
+      for (std::size_t l = 0; l < kLanes; l++) 
+         acc[l] += KernelLogPoisson(x[i+l], lambda[i+l], lnGamma1[i+l]);
+   for (; i < n; i++) acc[0] += KernelLogPoisson(x[i], lambda[i], lnGamma1[i]);
+   double sum = 0.0;
+   for (std::size_t l = 0; l < kLanes; l++) sum += acc[l];
+   return sum;
+}
+
+// Table of kernels for a specific instruction set
+struct Kernels {
+   double (*sumLogPoisson) (const double*, const double*, std::size_t);
+   double (*sumLogPoissonLnGamma) (const double*, const double*, const double*,
+                                   std::size_t);
+   const char* instructionSet;
+};
+
+// Instantiate the kernels for one instruction set
+#define MST_DEFINE_KERNELS(SUFFIX, ATTRIBUTES)                                 \
+   ATTRIBUTES double SumLogPoisson##SUFFIX (const double* x, const double* l,  \
+         std::size_t n) {                                                      \
+      return ImplSumLogPoisson(x, l, n);                                       \
+   }                                                                           \
+   ATTRIBUTES double SumLogPoissonLnGamma##SUFFIX (const double* x,            \
+         const double* l, const double* g, std::size_t n) {                    \
+      return ImplSumLogPoisson(x, l, g, n);                                    \
+   }
+
+MST_DEFINE_KERNELS(Generic, )
+#if MST_SIMD_DISPATCH
+MST_DEFINE_KERNELS(AVX2,   MST_TARGET("avx2,fma"))
+MST_DEFINE_KERNELS(AVX512, MST_TARGET("avx512f,avx512dq"))
+#endif
+
+Kernels SelectKernels() {
+#if MST_SIMD_DISPATCH
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+      return {&SumLogPoissonAVX512, &SumLogPoissonLnGammaAVX512, "AVX-512"};
+   if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      return {&SumLogPoissonAVX2, &SumLogPoissonLnGammaAVX2, "AVX2"};
+#endif
+   return {&SumLogPoissonGeneric, &SumLogPoissonLnGammaGeneric, "generic"};
+}
+
+// The selection is performed once (thread-safe initialization of statics)
+const Kernels& GetKernels() {
+   static const Kernels kernels = SelectKernels();
+   return kernels;
 }
+
+} // anonymous namespace
+
+double MSMath::SumLogPoisson(const double* x, const double* lambda, 
+                             std::size_t n) {
+   return GetKernels().sumLogPoisson(x, lambda, n);
+}
+
+double MSMath::SumLogPoisson(const double* x, const double* lambda, 
+                             const double* lnGamma1, std::size_t n) {
+   return GetKernels().sumLogPoissonLnGamma(x, lambda, lnGamma1, n);
+}
+
+double MSMath::FindRoot(const std::function<double(double)>& f, double a, double b,
+                        double fa, double fb, double tolerance, int maxIter) {
+   if (fa == 0) return a;
+   if (fb == 0) return b;
+   if ((fa > 0) == (fb > 0)) return std::numeric_limits<double>::quiet_NaN();
+
+   // b is the best estimate of the root and c the opposite end of the
+   // bracket; the step is an inverse quadratic interpolation (or a secant)
+   // if it falls well inside the bracket, a bisection otherwise
+   const double eps = std::numeric_limits<double>::epsilon();
+   double c = b, fc = fb, d = b - a, e = d;
+   for (int iter = 0; iter < maxIter; iter++) {
+      if ((fb > 0) == (fc > 0)) {
+         c = a; fc = fa;
+         d = e = b - a;
+      }
+      if (std::fabs(fc) < std::fabs(fb)) {
+         a = b;  b = c;  c = a;
+         fa = fb; fb = fc; fc = fa;
+      }
+      const double tol = 2*eps*std::fabs(b) + 0.5*tolerance;
+      const double m = 0.5*(c - b);
+      if (std::fabs(m) <= tol || fb == 0) return b;
+
+      if (std::fabs(e) >= tol && std::fabs(fa) > std::fabs(fb)) {
+         const double s = fb/fa;
+         double p, q;
+         if (a == c) {
+            p = 2*m*s;
+            q = 1 - s;
+         } else {
+            const double r = fb/fc;
+            q = fa/fc;
+            p = s*(2*m*q*(q - r) - (b - a)*(r - 1));
+            q = (q - 1)*(r - 1)*(s - 1);
+         }
+         if (p > 0) q = -q;
+         else       p = -p;
+         if (2*p < std::min(3*m*q - std::fabs(tol*q), std::fabs(e*q))) {
+            e = d;
+            d = p/q;
+         } else {
+            d = e = m;
+         }
+      } else {
+         d = e = m;
+      }
+
+      a = b; fa = fb;
+      b += std::fabs(d) > tol ? d : (m > 0 ? tol : -tol);
+      fb = f(b);
+   }
+   return b;
+}
+
+const char* MSMath::GetInstructionSet() {
+   return GetKernels().instructionSet;
+}
+
+} // namespace mst
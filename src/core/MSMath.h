@@ -22,6 +22,13 @@
  * the negative log likelihood of statistical models
  *
  * \details 
+ * The functions Sum* are the array versions of the corresponding scalar
+ * functions: they return the sum of the logarithms computed element-wise. 
+ * They do not print errors for parameters out of range but return the same
+ * values of the scalar functions (-inf or NaN). They are implemented with
+ * branch-free kernels that the compiler vectorizes, and the kernel matching
+ * the instruction set of the CPU (AVX-512, AVX2 or generic) is selected at
+ * runtime the first time one of the functions is called.
  *
  * \author Matteo Agostini
  */
@@ -29,6 +36,10 @@
 #ifndef MST_MSMath_H
 #define MST_MSMath_H
 
+// c/c++ libs
+#include <cstddef>
+#include <functional>
+
 namespace mst {
 
 namespace MSMath {
@@ -40,6 +51,23 @@ namespace MSMath {
    //! Log of an exponential distribution
    double LogExp (double x, double limit, double quantile=.9, double offset =0);
 
+   //! Sum of the log of Poissonian distributions over n elements
+   double SumLogPoisson (const double* x, const double* lambda, std::size_t n);
+   //! Sum of the log of Poissonian distributions over n elements using
+   //! precomputed constants lnGamma1[i] = ln(Gamma(x[i]+1))
+   double SumLogPoisson (const double* x, const double* lambda, 
+                         const double* lnGamma1, std::size_t n);
+
+   //! Name of the instruction set used by the Sum* functions
+   const char* GetInstructionSet();
+
+   //! Root of f in the interval [a,b] found with the Brent's method. The
+   //! values fa=f(a) and fb=f(b) must be given and have opposite sign (NaN is
+   //! returned otherwise). The search stops when the interval is smaller than
+   //! tolerance or after maxIter evaluations of f
+   double FindRoot (const std::function<double(double)>& f, double a, double b,
+                    double fa, double fb, double tolerance, int maxIter = 50);
+
 } // namespace MSMath
 
 } // namespace mst
@@ -14,19 +14,50 @@
 // License along with this library; if not, write to the Free Software
 // Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 
+// c/c++ libs
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <mutex>
+#include <numeric>
+#include <vector>
+
 // root libs
 #include <TString.h>
 
 // m-stats libs
+#include "MSLBFGSB.h"
 #include "MSMinimizer.h"
+#include "MSSobol.h"
 
 namespace mst {
 
-MSMinimizer* MSMinimizer::global_pointer = 0;
+namespace {
+// Minimizer whose models are evaluated by the FCN called on this thread. All
+// calls of minuit are issued within a CurrentMinimizerGuard of the minimizer
+// owning it, such that the FCN never evaluates the models of another one
+thread_local MSMinimizer* gCurrentMinimizer = nullptr;
+// Mutex protecting the creation/deletion of TMinuit objects, which register
+// themselves in the global lists of ROOT
+std::mutex gMinuitMutex;
+
+// Set the current minimizer of the thread and restore the previous one when
+// the object goes out of scope (nested fits)
+class CurrentMinimizerGuard {
+   public:
+      CurrentMinimizerGuard(MSMinimizer* minimizer) : fPrevious(gCurrentMinimizer) {
+         gCurrentMinimizer = minimizer;
+      }
+      ~CurrentMinimizerGuard() { gCurrentMinimizer = fPrevious; }
+   private:
+      MSMinimizer* fPrevious;
+};
+} // anonymous namespace
 
 MSMinimizer::MSMinimizer(const std::string& name) : MSObject(name)
 {
    fModelVector = new MSModelVector();
+   fGlobalParMap = new MSParameterMap();
    fLocalParMap = new MSParameterMap();
 }
 
@@ -37,12 +68,76 @@ MSMinimizer::~MSMinimizer()
       delete fModelVector;
    }
 
+   if (fGlobalParMap) {
+      for (auto& it : *fGlobalParMap) delete it.second;
+      delete fGlobalParMap;
+   }
+
    if (fLocalParMap) {
       for (auto& it : *fLocalParMap) delete it.second;
       delete fLocalParMap;
    }
 
-   delete fMinuit;
+   {
+      std::lock_guard<std::mutex> lock(gMinuitMutex);
+      delete fMinuit;
+   }
+   delete fThreadPool;
+}
+
+MSMinimizer* MSMinimizer::Clone() const
+{
+   MSMinimizer* clone = new MSMinimizer(GetName());
+
+   // Copy the parameters first, such that the cloned models find them in the
+   // new map when bound to it
+   for (const auto& it : *fGlobalParMap)
+      clone->fGlobalParMap->insert(MSParameterPair(it.first, 
+                                                   new MSParameter(*it.second)));
+   for (const auto& i : *fModelVector) {
+      MSModel* model = i->Clone();
+      if (model == nullptr) {
+         delete clone;
+         return nullptr;
+      }
+      clone->AddModel(model);
+   }
+
+   clone->SetVerbosityLevel(GetVerbosityLevel());
+   clone->fMinuitMaxCalls   = fMinuitMaxCalls;
+   clone->fMinuitTollerance = fMinuitTollerance;
+   clone->fUseGradient      = fUseGradient;
+   clone->fParScaling       = fParScaling;
+   clone->fParLogTransform  = fParLogTransform;
+   clone->fNLLOffsetMode    = fNLLOffsetMode;
+   clone->InitializeMinuit(-1, fMinuit ? fMinuit->fUp : 0.5);
+
+   // the clone starts from the result of the last minimization
+   clone->fMinuitErrorFlag  = fMinuitErrorFlag;
+   clone->fMinNLL           = fMinNLL;
+   clone->fEDM              = fEDM;
+   clone->fCovQual          = fCovQual;
+
+   return clone;
+}
+
+void MSMinimizer::SetNThreads(unsigned int nThreads)
+{
+   delete fThreadPool;
+   fThreadPool = nullptr;
+   if (nThreads != 1) {
+      fThreadPool = new MSThreadPool(nThreads);
+      if (fThreadPool->GetNThreads() == 1) {
+         delete fThreadPool;
+         fThreadPool = nullptr;
+      }
+   }
+   for (auto& i : *fModelVector) i->SetThreadPool(fThreadPool);
+}
+
+unsigned int MSMinimizer::GetNThreads() const
+{
+   return fThreadPool ? fThreadPool->GetNThreads() : 1;
 }
 
 TMinuit* MSMinimizer::InitializeMinuit (int verbosity, double errVal)
@@ -53,16 +148,16 @@ TMinuit* MSMinimizer::InitializeMinuit (int verbosity, double errVal)
                 << std::endl;
       exit(1);
    }
-   // Set global pointer
-   global_pointer = this;
-
-   // Fixed the pointer to the global parameter list
-   fGlobalParMap = fModelVector->at(0)->GetParameters();
-
-   // Initialize minuit
-   delete fMinuit;
-   fMinuit = new TMinuit(fGlobalParMap->size());
+   // Initialize minuit. All parameters will be synced at the next call of
+   // SyncFitParameters
+   {
+      std::lock_guard<std::mutex> lock(gMinuitMutex);
+      delete fMinuit;
+      fMinuit = new TMinuit(fGlobalParMap->size());
+   }
    fMinuit->SetFCN(&MSMinimizer::FCNNLLLikelihood);
+   fMinuitGradient = false;
+   fMinuitSynced = false;
 
    SetMinuitVerbosity(verbosity);
    SetMinuitErrVal(errVal);
@@ -77,6 +172,7 @@ void MSMinimizer::SetMinuitErrVal(double errVal)
                 << std::endl;
    }
    fMinuitArglist[0] = errVal;
+   CurrentMinimizerGuard guard(this);
    fMinuit->mnexcm("SET ERR", fMinuitArglist, 1, fMinuitErrorFlag);
 }
 
@@ -86,28 +182,371 @@ void MSMinimizer::SetMinuitVerbosity(int level)
       std::cerr << "MSMinimizer::SetMinuitVerbosity: minuit not initialized yet"
                 << std::endl;
    }
+   CurrentMinimizerGuard guard(this);
    fMinuit->SetPrintLevel(level);
 }
 
-void MSMinimizer::SyncFitParameters( bool resetParStartVal)
+bool MSMinimizer::HasGradient() const
 {
-   // Check whether minuit has been last sync against this minimizer
-   // and define value of global pointer
-   bool forceUpdateAll = false;
-   if (global_pointer != this) {
-      forceUpdateAll = true;
-      global_pointer = this;
+   if (!fUseGradient) return false;
+   for (const auto& i : *fModelVector) if (!i->HasGradient()) return false;
+   return true;
+}
+
+bool MSMinimizer::HasHessian() const
+{
+   for (const auto& i : *fModelVector) if (!i->HasHessian()) return false;
+   return true;
+}
+
+bool MSMinimizer::HasEMTerms() const
+{
+   for (const auto& i : *fModelVector) if (!i->HasEMTerms()) return false;
+   return true;
+}
+
+bool MSMinimizer::ComputeCovariance(bool updateMinuit)
+{
+   if (!fMinuit || !fGlobalParMap) {
+      std::cerr << "MSMinimizer::ComputeCovariance: minuit not initialized yet"
+                << std::endl;
+      return false;
+   }
+   if (!HasHessian()) {
+      std::cerr << "MSMinimizer::ComputeCovariance: analytic Hessian not "
+                << "provided by all models" << std::endl;
+      return false;
+   }
+   // the table of the parameters is built by the first sync (e.g. not yet
+   // done by a new clone)
+   if (fParTable.size() != fGlobalParMap->size()) SyncFitParameters();
+
+   // Best fit point and indices of the free parameters
+   const std::size_t nPar = fParTable.size();
+   std::vector<double> par;
+   std::vector<int> freePar;
+   for (const auto& it : fParTable) {
+      if (!it->IsFixed()) freePar.push_back(par.size());
+      par.push_back(it->GetFitBestValue());
+   }
+   const int nFree = freePar.size();
+
+   // Hessian of the NLL summed over all models
+   std::vector<double> hess(nPar*nPar, 0.0);
+   for (const auto& i : *fModelVector) 
+      i->NLogLikelihoodHessian(par.data(), hess.data());
+
+   // Invert the Hessian restricted to the free parameters. The covariance is
+   // scaled by 2*errdef to match the minuit convention (errdef = 0.5 for NLL)
+   TMatrixDSym freeCov(nFree);
+   for (int i = 0; i < nFree; i++)
+      for (int j = 0; j < nFree; j++)
+         freeCov(i,j) = hess[freePar[i]*nPar + freePar[j]];
+   double det = 0.0;
+   freeCov.Invert(&det);
+   if (!freeCov.IsValid() || !(det > 0)) {
+      std::cerr << "MSMinimizer::ComputeCovariance: Hessian not invertible"
+                << std::endl;
+      return false;
+   }
+   for (int i = 0; i < nFree; i++) {
+      if (!(freeCov(i,i) > 0)) {
+         std::cerr << "MSMinimizer::ComputeCovariance: Hessian not positive "
+                   << "definite" << std::endl;
+         return false;
+      }
+   }
+
+   fCovariance.ResizeTo(nPar, nPar);
+   for (std::size_t i = 0; i < nPar; i++)
+      for (std::size_t j = 0; j < nPar; j++) fCovariance(i,j) = 0.0;
+   for (int i = 0; i < nFree; i++)
+      for (int j = 0; j < nFree; j++)
+         fCovariance(freePar[i],freePar[j]) = 2.0*fMinuit->fUp*freeCov(i,j);
+
+   // Update the errors of the parameters
+   for (int i = 0; i < nFree; i++) 
+      fParTable[freePar[i]]->SetFitBestValueErr(
+            sqrt(fCovariance(freePar[i],freePar[i])));
+
+   if (updateMinuit) {
+      // Minuit stores the covariance of the internal parameters as a packed
+      // lower triangular matrix in units of errdef (mnemat and mnwerr 
+      // multiply it by fUp). The external covariance is converted using
+      // the derivatives of the external/internal parameter transformation
+      // and of the rescaling of the parameters
+      if (fMinuit->fNpar != nFree) {
+         std::cerr << "MSMinimizer::ComputeCovariance: minuit not synced with "
+                   << "the parameter map" << std::endl;
+         return false;
+      }
+      CurrentMinimizerGuard guard(this);
+      std::vector<double> dxdi(nFree);
+      for (int i = 0; i < nFree; i++) {
+         const int ei = fMinuit->fNexofi[i] - 1;
+         fMinuit->mndxdi(fMinuit->fX[i], i, dxdi[i]);
+         dxdi[i] *= GetTransformDerivative(ei, ToInternal(ei, par[ei]));
+      }
+      for (int i = 0; i < nFree; i++) {
+         const int ei = fMinuit->fNexofi[i] - 1;
+         for (int j = 0; j <= i; j++) {
+            const int ej = fMinuit->fNexofi[j] - 1;
+            fMinuit->fVhmat[i*(i+1)/2 + j] = 
+               fCovariance(ei,ej) / (dxdi[i]*dxdi[j]*fMinuit->fUp);
+         }
+      }
+      // flag the matrix as full accurate covariance and update the errors.
+      // This overrides the internal state of minuit without its checks (e.g.
+      // mnpsdf): the matrix is only required to be invertible with positive
+      // diagonal
+      fMinuit->fISW[1] = 3;
+      fMinuit->fDcovar = 0.0;
+      fMinuit->mnwerr();
+      fCovQual = 3;
    }
 
+   return true;
+}
+
+bool MSMinimizer::CheckCovariance(double tolerance) const
+{
+   // Run HESSE on a clone started from the best fit point, such that the
+   // state of this minimizer is not modified
+   MSMinimizer* hesse = Clone();
+   if (hesse == nullptr) {
+      std::cerr << "MSMinimizer::CheckCovariance: models not supporting clones"
+                << std::endl;
+      return false;
+   }
+   for (const auto& it : *fGlobalParMap)
+      hesse->GetParameter(it.first)->SetFitStartValue(it.second->GetFitBestValue());
+   hesse->Minimize("HESSE", true);
+
+   bool agree = hesse->GetMinuitStatus() == 0;
+   if (!agree) std::cerr << "MSMinimizer::CheckCovariance: HESSE failed" << std::endl;
+   for (const auto& it : *fGlobalParMap) {
+      if (!agree || it.second->IsFixed()) continue;
+      const double err      = it.second->GetFitBestValueErr();
+      const double errHesse = hesse->GetParameter(it.first)->GetFitBestValueErr();
+      if (!(std::fabs(err - errHesse) <= tolerance*errHesse)) {
+         std::cerr << "MSMinimizer::CheckCovariance: error of " << it.first 
+                   << " = " << err << " while HESSE gives " << errHesse 
+                   << std::endl;
+         agree = false;
+      }
+   }
+   delete hesse;
+   return agree;
+}
+
+TMatrixDSym MSMinimizer::GetCorrelation() const
+{
+   TMatrixDSym correlation(fCovariance);
+   const int n = fCovariance.GetNrows();
+   for (int i = 0; i < n; i++) {
+      for (int j = 0; j < n; j++) {
+         const double norm = sqrt(fCovariance(i,i)*fCovariance(j,j));
+         correlation(i,j) = norm > 0 ? fCovariance(i,j)/norm : 0.0;
+      }
+   }
+   return correlation;
+}
+
+bool MSMinimizer::SetFitStartValuesFromLeastSquares()
+{
+   const std::size_t nPar = fGlobalParMap->size();
+   std::vector<MSParameter*> parTable;
+   for (const auto& it : *fGlobalParMap) parTable.push_back(it.second);
+
+   // Normal equations summed over the models providing them. The parameters
+   // on which other models depend are excluded from the fit
+   std::vector<double> matrix(nPar*nPar, 0.0), vector(nPar, 0.0);
+   std::vector<bool> fitted(nPar, false), excluded(nPar, false);
+   for (const auto& i : *fModelVector) {
+      i->ResolveParameters();
+      const bool hasTerms = i->HasLeastSquaresTerms();
+      if (hasTerms) i->AddLeastSquaresTerms(matrix.data(), vector.data());
+      for (const auto& d : i->GetParameterDependencies()) {
+         if (hasTerms) fitted[d] = true;
+         else        excluded[d] = true;
+      }
+   }
+
+   std::vector<double> x(nPar), lower(nPar), upper(nPar);
+   std::vector<std::size_t> free;
+   for (std::size_t d = 0; d < nPar; d++) {
+      const MSParameter* par = parTable[d];
+      x[d] = par->GetFitStartValue();
+      lower[d] = par->IsRangeMinSet() ? par->GetRangeMin() : 0.0;
+      upper[d] = par->IsRangeMaxSet() ? par->GetRangeMax() 
+                                      : std::numeric_limits<double>::infinity();
+      if (fitted[d] && !excluded[d] && !par->IsFixed() && matrix[d*nPar + d] > 0) {
+         free.push_back(d);
+         x[d] = std::min(std::max(x[d], lower[d]), upper[d]);
+      }
+   }
+   if (free.empty()) return false;
+
+   // Bounded coordinate descent: each parameter is moved to the minimum of
+   // the quadratic form along its axis and clipped to the range. The loop
+   // stops when no parameter moves by more than 1e-6 of its uncertainty
+   const int maxSweeps = 10000;
+   for (int sweep = 0; sweep < maxSweeps; sweep++) {
+      double maxStep = 0.0;
+      for (const auto& d : free) {
+         const double* row = &matrix[d*nPar];
+         double grad = -vector[d];
+         for (std::size_t l = 0; l < nPar; l++) grad += row[l] * x[l];
+         const double value = std::min(std::max(x[d] - grad/row[d], lower[d]), upper[d]);
+         maxStep = std::max(maxStep, std::fabs(value - x[d]) * sqrt(row[d]));
+         x[d] = value;
+      }
+      if (maxStep < 1e-6) break;
+   }
+
+   for (const auto& d : free) {
+      if (fVerbosity) std::cerr << "MSMinimizer::SetFitStartValuesFromLeastSquares: "
+                                << "par[" << d << "] \""
+                                << parTable[d]->GetName() << "\" -> "
+                                << x[d] << std::endl;
+      parTable[d]->SetFitStartValue(x[d]);
+   }
+   return true;
+}
+
+void MSMinimizer::ComputeParameterScales()
+{
+   const std::size_t nPar = fParTable.size();
+   fParScale.assign(nPar, 1.0);
+   fParLog.assign(nPar, false);
+   fParTransformed = false;
+   if (!fParScaling) return;
+
+   // Diagonal of the Hessian at the start values. Without analytic Hessian,
+   // second differences are computed with the start steps (shifted inside
+   // the range close to the bounds)
+   std::vector<double> x(nPar), diag(nPar, 0.0);
+   for (std::size_t d = 0; d < nPar; d++) x[d] = fParTable[d]->GetFitStartValue();
+   if (HasHessian()) {
+      std::vector<double> hess(nPar*nPar, 0.0);
+      for (const auto& i : *fModelVector) i->NLogLikelihoodHessian(x.data(), hess.data());
+      for (std::size_t d = 0; d < nPar; d++) diag[d] = hess[d*nPar + d];
+   } else {
+      const double nll = EvaluateModels(x.data(), nullptr);
+      for (std::size_t d = 0; d < nPar; d++) {
+         const MSParameter* par = fParTable[d];
+         const double start = x[d], h = par->GetFitStartStep();
+         double center = start;
+         if      (par->IsRangeSet() && start - h < par->GetRangeMin()) center = start + h;
+         else if (par->IsRangeSet() && start + h > par->GetRangeMax()) center = start - h;
+         x[d] = center - h;
+         const double nllLo = EvaluateModels(x.data(), nullptr);
+         x[d] = center + h;
+         const double nllHi = EvaluateModels(x.data(), nullptr);
+         x[d] = center;
+         const double nllCenter = center == start ? nll : EvaluateModels(x.data(), nullptr);
+         x[d] = start;
+         diag[d] = (nllLo + nllHi - 2.0*nllCenter)/(h*h);
+      }
+   }
+
+   // The scale is the uncertainty of the parameter. In logarithmic scale it
+   // is the relative uncertainty, limited to 1 for parameters compatible
+   // with their lower bound
+   for (std::size_t d = 0; d < nPar; d++) {
+      const MSParameter* par = fParTable[d];
+      const double sigma = diag[d] > 0 && std::isfinite(diag[d]) ? 
+                           sqrt(2.0*fMinuit->fUp/diag[d]) : par->GetFitStartStep();
+      if (!(sigma > 0)) continue;
+      if (fParLogTransform && par->IsRangeSet() && par->GetRangeMin() > 0) {
+         fParLog[d] = true;
+         fParScale[d] = std::min(sigma/std::max(x[d], par->GetRangeMin()), 1.0);
+      } else {
+         fParScale[d] = sigma;
+      }
+      if (fVerbosity) std::cerr << "MSMinimizer::ComputeParameterScales: "
+                                << "par[" << d << "] \""
+                                << par->GetName() << "\" -> scale " 
+                                << fParScale[d] << (fParLog[d] ? " (log)" : "")
+                                << std::endl;
+   }
+   fParTransformed = true;
+}
+
+void MSMinimizer::DefineMinuitParameter(int d, const MSParameter* par)
+{
+   double start = par->GetFitStartValue();
+   double step  = par->GetFitStartStep();
+   double rangeMin = par->GetRangeMin(), rangeMax = par->GetRangeMax();
+   if (fParLog[d]) {
+      // step converted at the start value: ln(1+step/x) ~ step/x
+      start = std::max(start, rangeMin);
+      step = log(1.0 + step/start)/fParScale[d];
+   } else {
+      step /= fParScale[d];
+   }
+   start = ToInternal(d, start);
+   // minuit does not bound parameters with equal range edges
+   if (rangeMin != rangeMax) {
+      rangeMin = ToInternal(d, rangeMin);
+      rangeMax = ToInternal(d, rangeMax);
+   }
+   fMinuit->mnparm(d, par->GetName().data(), start, step, rangeMin, rangeMax,
+                   fMinuitErrorFlag);
+}
+
+void MSMinimizer::SyncFitParameters( bool resetParStartVal)
+{
    // Initialize minuit if not done manually
    if (!fMinuit) InitializeMinuit();
 
+   // Sync all fields if minuit has been just initialized
+   bool forceUpdateAll = !fMinuitSynced;
+   fMinuitSynced = true;
+   CurrentMinimizerGuard guard(this);
+
+   // Build the table of parameters indexed as in the Minuit array and resolve
+   // the indexes used by the models
+   fParTable.clear();
+   for (const auto& it : *fGlobalParMap) fParTable.push_back(it.second);
+   for (const auto& i : *fModelVector) i->ResolveParameters();
+
+   // Group the models for the parallel evaluation
+   BuildModelBatches();
+
+   // The offsets of the NLL follow the start values. Otherwise minuit keeps
+   // the NLL of the previous step and the offsets must not change
+   if (forceUpdateAll || resetParStartVal || 
+       fModelNLLOffset.size() != fModelVector->size())
+      ComputeNLLOffsets();
+
+   // Compute the scales of the parameters when minuit is initialized or the
+   // table of parameters changes. All parameters are then redefined
+   if (forceUpdateAll || fParScale.size() != fParTable.size()) {
+      ComputeParameterScales();
+      forceUpdateAll = true;
+   }
+
+   // Switch minuit to user-gradient mode if all models provide the gradient.
+   // The argument 1 disables the check against the numerical derivatives
+   const bool useGradient = HasGradient();
+   if (useGradient != fMinuitGradient) {
+      if (fVerbosity) std::cerr << "MSMinimizer::SyncFitParameters: "
+                                << "analytic gradient "
+                                << (useGradient ? "enabled" : "disabled")
+                                << std::endl;
+      fMinuitArglist[0] = 1;
+      if (useGradient) fMinuit->mnexcm("SET GRAD",   fMinuitArglist, 1, fMinuitErrorFlag);
+      else             fMinuit->mnexcm("SET NOGRAD", fMinuitArglist, 0, fMinuitErrorFlag);
+      fMinuitGradient = useGradient;
+   }
+
    const MSParameterMap::const_iterator gItB = fGlobalParMap->begin();
    const MSParameterMap::const_iterator gItE = fGlobalParMap->end();
 
    // Parse parameter to minuit (only if different from previous call)
-   for (MSParameterMap::const_iterator gIt = gItB; gIt != gItE; ++gIt) {
-      const int d = distance(gItB, gIt);
+   int d = 0;
+   for (MSParameterMap::const_iterator gIt = gItB; gIt != gItE; ++gIt, ++d) {
       MSParameterMap::const_iterator lIt = fLocalParMap->find(gIt->first);
 
       // Intialize all parameters the first time the function is called or
@@ -119,12 +558,7 @@ void MSMinimizer::SyncFitParameters( bool resetParStartVal)
                                    << " -> synced all fields"
                                    << std::endl;
 
-         fMinuit->mnparm ( d, gIt->second->GetName().data(),
-               gIt->second->GetFitStartValue(),
-               gIt->second->GetFitStartStep(),
-               gIt->second->GetRangeMin(),
-               gIt->second->GetRangeMax(),
-               fMinuitErrorFlag);
+         DefineMinuitParameter(d, gIt->second);
 
          if (gIt->second->IsFixed()) {
             if (fVerbosity) std::cerr << "MSMinimizer::SyncFitParameters: "
@@ -146,7 +580,7 @@ void MSMinimizer::SyncFitParameters( bool resetParStartVal)
                                       << " -> synced starting value"
                                       << std::endl;
             fMinuitArglist[0] = d+1;
-            fMinuitArglist[1] = gIt->second->GetFitStartValue();
+            fMinuitArglist[1] = ToInternal(d, gIt->second->GetFitStartValue());
             fMinuit->mnexcm("SET PAR",fMinuitArglist,2, fMinuitErrorFlag);
          }
 
@@ -182,12 +616,7 @@ void MSMinimizer::SyncFitParameters( bool resetParStartVal)
                                       << " -> synced all fields"
                                       << std::endl;
 
-            fMinuit->mnparm ( d, gIt->second->GetName().data(),
-                                 gIt->second->GetFitStartValue(),
-                                 gIt->second->GetFitStartStep(),
-                                 gIt->second->GetRangeMin(),
-                                 gIt->second->GetRangeMax(),
-                                 fMinuitErrorFlag);
+            DefineMinuitParameter(d, gIt->second);
          }
       }
    }
@@ -205,31 +634,77 @@ void MSMinimizer::SyncFitParameters( bool resetParStartVal)
 
 }
 
+void MSMinimizer::SetNLLOffset(const std::string& mode)
+{
+   if (mode != "none" && mode != "saturated" && mode != "start") {
+      std::cerr << "MSMinimizer::SetNLLOffset: unknown mode \"" << mode 
+                << "\"" << std::endl;
+      exit(1);
+   }
+   fNLLOffsetMode = mode;
+   // redefine all parameters such that minuit forgets the previous minimum
+   fMinuitSynced = false;
+}
+
+void MSMinimizer::ComputeNLLOffsets()
+{
+   const std::size_t nModels = fModelVector->size();
+   fModelNLLOffset.assign(nModels, 0.0);
+   fNLLOffset = 0.0;
+   if (fNLLOffsetMode == "none") return;
+
+   std::vector<double> x(fParTable.size());
+   for (std::size_t d = 0; d < fParTable.size(); d++) 
+      x[d] = fParTable[d]->GetFitStartValue();
+
+   for (std::size_t i = 0; i < nModels; i++) {
+      MSModel* model = fModelVector->at(i);
+      const double offset = fNLLOffsetMode == "saturated" ? 
+                            model->GetSaturatedNLL() : 
+                            model->NLogLikelihood(x.data());
+      // a model not defined at the start values is not offset
+      fModelNLLOffset[i] = std::isfinite(offset) ? offset : 0.0;
+      fNLLOffset += fModelNLLOffset[i];
+   }
+   if (fVerbosity) std::cerr << "MSMinimizer::ComputeNLLOffsets: "
+                             << "offset (" << fNLLOffsetMode << ") = "
+                             << fNLLOffset << std::endl;
+}
+
 void MSMinimizer::Minimize(const std::string& minimizer, bool resetFitStartValue) {
+   if (minimizer == "LBFGSB") {
+      MinimizeLBFGSB(resetFitStartValue);
+      return;
+   } else if (minimizer == "EM") {
+      MinimizeEM(resetFitStartValue);
+      return;
+   }
+
    // Sync parameters
    SyncFitParameters(resetFitStartValue);
    // Set maxcalls
    fMinuitArglist[0] = fMinuitMaxCalls;
    // Set tolerance
    fMinuitArglist[1] = fMinuitTollerance;
-   // Run actual minimization
+   // Run actual minimization. The FCN evaluates the models of this minimizer
+   CurrentMinimizerGuard guard(this);
    fMinuit->mnexcm(minimizer.c_str(), fMinuitArglist, 2, fMinuitErrorFlag);
 
    if (GetMinuitStatus()) fNMinuitFails++;
 
    // Retrive fit results from minuit and store info
-   MSParameterMap::const_iterator gIt0 = fGlobalParMap->begin();
-   for (MSParameterMap::const_iterator gIt = fGlobalParMap->begin();
-         gIt != fGlobalParMap->end(); ++gIt) {
-      int d = distance(gIt0, gIt);
+   for (std::size_t d = 0; d < fParTable.size(); d++) {
       double fitBestValue, fitBestValueErr;
       double fitRangeMin, fitRangeMax;
       TString name;
       int index;
       fMinuit->mnpout(d, name, fitBestValue, fitBestValueErr,
                       fitRangeMin, fitRangeMax, index);
-      gIt->second->SetFitBestValue(fitBestValue);
-      gIt->second->SetFitBestValueErr(fitBestValueErr);
+      // convert to the original units
+      fitBestValueErr *= std::fabs(GetTransformDerivative(d, fitBestValue));
+      fitBestValue = ToExternal(d, fitBestValue);
+      fParTable[d]->SetFitBestValue(fitBestValue);
+      fParTable[d]->SetFitBestValueErr(fitBestValueErr);
    }
 
    // Retrive info about the status of the minimation
@@ -238,12 +713,409 @@ void MSMinimizer::Minimize(const std::string& minimizer, bool resetFitStartValue
    fMinuit->mnstat(fMinNLL,fEDM,errdef,npari,nparx,fCovQual);
 }
 
-void MSMinimizer::FCNNLLLikelihood(int & /*npar*/, double * /*grad*/,
-      double &fval, double * par, int /*flag*/)
+void MSMinimizer::MinimizeMultiStart(const MSFitProcedure& fit)
 {
-   fval = 0.0;
-   MSModelVector* modelVector = global_pointer->fModelVector;
-   for (const auto& i : *modelVector) fval += i->NLogLikelihood(par);
+   // Sync parameters, such that the best fit values can be passed to minuit
+   SyncFitParameters(true);
+   const std::size_t nPar = fParTable.size();
+   const unsigned int nStarts = std::max(fNMultiStarts, 1u);
+
+   // Only the free parameters with a range are sampled
+   std::vector<std::size_t> sampled;
+   for (std::size_t d = 0; d < nPar; d++) {
+      const MSParameter* par = fParTable[d];
+      if (!par->IsFixed() && par->IsRangeSet() && 
+          par->GetRangeMax() > par->GetRangeMin()) 
+         sampled.push_back(d);
+   }
+
+   // Clone the minimizer for each start (serially, see Clone)
+   std::vector<MSMinimizer*> starts(nStarts, nullptr);
+   std::vector<double> u(std::max<std::size_t>(sampled.size(), 1));
+   MSSobol sobol(u.size());
+   for (unsigned int s = 0; s < nStarts; s++) {
+      starts[s] = Clone();
+      if (starts[s] == nullptr) {
+         std::cerr << "MSMinimizer::MinimizeMultiStart: models not supporting "
+                   << "MSModel::Clone" << std::endl;
+         exit(1);
+      }
+      if (s == 0) continue;
+      sobol.Next(u.data());
+      for (std::size_t k = 0; k < sampled.size(); k++) {
+         const MSParameter* par = fParTable[sampled[k]];
+         starts[s]->GetParameter(par->GetName())->SetFitStartValue(
+               par->GetRangeMin() + u[k]*par->GetRangeWidth(), false);
+      }
+   }
+
+   // Run the fits. Each clone evaluates its models serially
+   auto run = [&] (std::size_t s) { fit(starts[s]); };
+   if (fThreadPool) fThreadPool->ParallelFor(nStarts, run);
+   else for (unsigned int s = 0; s < nStarts; s++) run(s);
+
+   // Choose the converged start with the lowest NLL (the lowest NLL if none
+   // converged)
+   std::size_t best = 0;
+   bool bestConverged = false;
+   double bestNLL = std::numeric_limits<double>::infinity();
+   fNStartsConverged = 0;
+   for (unsigned int s = 0; s < nStarts; s++) {
+      const bool converged = starts[s]->GetMinuitStatus() == 0;
+      const double nll = starts[s]->GetMinNLL();
+      if (converged) fNStartsConverged++;
+      if (!std::isfinite(nll)) continue;
+      if ((converged && !bestConverged) || 
+          (converged == bestConverged && nll < bestNLL)) {
+         best = s;
+         bestConverged = converged;
+         bestNLL = nll;
+      }
+   }
+   fNStartsAgree = 0;
+   if (bestConverged)
+      for (unsigned int s = 0; s < nStarts; s++)
+         if (starts[s]->GetMinuitStatus() == 0 && 
+             std::fabs(starts[s]->GetMinNLL() - bestNLL) <= fMultiStartTolerance)
+            fNStartsAgree++;
+
+   if (fVerbosity) std::cerr << "MSMinimizer::MinimizeMultiStart: best start "
+                             << best << " NLL= " << bestNLL << ", "
+                             << fNStartsAgree << " of " << fNStartsConverged
+                             << " converged starts agree" << std::endl;
+
+   // Store the result of the best start and pass it to minuit
+   const MSMinimizer* bestStart = starts[best];
+   std::vector<double> x(nPar), error(nPar);
+   for (std::size_t d = 0; d < nPar; d++) {
+      const MSParameter* par = bestStart->fGlobalParMap->at(fParTable[d]->GetName());
+      x[d] = par->GetFitBestValue();
+      error[d] = par->GetFitBestValueErr();
+   }
+   SetMinuitParameters(x, error);
+   fMinuitErrorFlag = bestStart->fMinuitErrorFlag;
+   if (GetMinuitStatus()) fNMinuitFails++;
+   fMinNLL = bestStart->GetMinNLL() - fNLLOffset;
+   fEDM = bestStart->fEDM;
+   fCovQual = bestStart->fCovQual;
+
+   for (auto& i : starts) delete i;
+}
+
+int MSMinimizer::GetMinuitParameters(std::vector<double>& x, 
+                                     std::vector<double>& lower,
+                                     std::vector<double>& upper,
+                                     std::vector<double>& error)
+{
+   CurrentMinimizerGuard guard(this);
+   const std::size_t nPar = fParTable.size();
+   x.resize(nPar); lower.resize(nPar); upper.resize(nPar); error.resize(nPar);
+   int nFree = 0;
+   for (std::size_t d = 0; d < nPar; d++) {
+      double rangeMin, rangeMax;
+      TString name;
+      int index;
+      fMinuit->mnpout(d, name, x[d], error[d], rangeMin, rangeMax, index);
+      // convert to the original units
+      error[d] *= std::fabs(GetTransformDerivative(d, x[d]));
+      x[d] = ToExternal(d, x[d]);
+      if (rangeMin != rangeMax) {
+         rangeMin = ToExternal(d, rangeMin);
+         rangeMax = ToExternal(d, rangeMax);
+      }
+      if (!(error[d] > 0)) error[d] = fParTable[d]->GetFitStartStep();
+      if (fParTable[d]->IsFixed()) {
+         lower[d] = upper[d] = x[d];
+         continue;
+      }
+      // minuit does not bound parameters with equal range edges
+      if (rangeMin == rangeMax) {
+         lower[d] = -std::numeric_limits<double>::infinity();
+         upper[d] =  std::numeric_limits<double>::infinity();
+      } else {
+         lower[d] = rangeMin;
+         upper[d] = rangeMax;
+      }
+      nFree++;
+   }
+   return nFree;
+}
+
+void MSMinimizer::SetMinuitParameters(const std::vector<double>& x, 
+                                      const std::vector<double>& error)
+{
+   CurrentMinimizerGuard guard(this);
+   for (std::size_t d = 0; d < fParTable.size(); d++) {
+      fParTable[d]->SetFitBestValue(x[d]);
+      if (fParTable[d]->IsFixed()) continue;
+      fParTable[d]->SetFitBestValueErr(error[d]);
+      fMinuitArglist[0] = d+1;
+      fMinuitArglist[1] = ToInternal(d, x[d]);
+      int errorFlag = 0;
+      fMinuit->mnexcm("SET PAR", fMinuitArglist, 2, errorFlag);
+   }
+}
+
+void MSMinimizer::MinimizeLBFGSB(bool resetFitStartValue)
+{
+   // Sync parameters
+   SyncFitParameters(resetFitStartValue);
+
+   // Start from the parameters stored in minuit. Minuit errors are used as
+   // scales
+   const std::size_t nPar = fParTable.size();
+   std::vector<double> x, lower, upper, scale;
+   const int nFree = GetMinuitParameters(x, lower, upper, scale);
+
+   // NLL and gradient. Without analytic gradient, the derivatives are
+   // computed with central differences (one-sided at the bounds)
+   const bool useGradient = HasGradient();
+   std::vector<double> par(x);
+   auto objective = [&] (const double* xt, double* grad) {
+      std::copy(xt, xt + nPar, par.begin());
+      if (useGradient) return EvaluateModels(par.data(), grad);
+      const double nll = EvaluateModels(par.data(), nullptr);
+      for (std::size_t d = 0; d < nPar; d++) {
+         grad[d] = 0.0;
+         if (lower[d] == upper[d]) continue;
+         const double h = 1e-6*std::max(std::fabs(xt[d]), scale[d]);
+         const double xHi = std::min(xt[d] + h, upper[d]);
+         const double xLo = std::max(xt[d] - h, lower[d]);
+         par[d] = xHi;
+         const double nllHi = EvaluateModels(par.data(), nullptr);
+         par[d] = xLo;
+         const double nllLo = EvaluateModels(par.data(), nullptr);
+         par[d] = xt[d];
+         grad[d] = (nllHi - nllLo)/(xHi - xLo);
+      }
+      return nll;
+   };
+
+   // The maximum number of calls refers to NLL evaluations as for minuit
+   MSLBFGSB lbfgs;
+   lbfgs.SetMaxCalls(useGradient ? fMinuitMaxCalls : 
+                     std::max(2, fMinuitMaxCalls/(2*nFree + 1)));
+   lbfgs.SetTolerance(fMinuitTollerance);
+   lbfgs.SetErrorDef(fMinuit->fUp);
+   fMinuitErrorFlag = lbfgs.Minimize(objective, x, lower, upper, scale);
+
+   if (GetMinuitStatus()) fNMinuitFails++;
+
+   // The errors are estimated from the approximated inverse Hessian 
+   // (parameters on a bound keep the previous error)
+   const std::vector<double>& invHessDiag = lbfgs.GetInverseHessianDiagonal();
+   for (std::size_t d = 0; d < nPar; d++) 
+      if (invHessDiag[d] > 0) scale[d] = sqrt(2.0*fMinuit->fUp*invHessDiag[d]);
+   SetMinuitParameters(x, scale);
+
+   fMinNLL = lbfgs.GetMinFCN();
+   fEDM = lbfgs.GetEDM();
+   // approximation only, not accurate
+   fCovQual = 1;
+}
+
+void MSMinimizer::MinimizeEM(bool resetFitStartValue)
+{
+   if (!HasEMTerms()) {
+      std::cerr << "MSMinimizer::MinimizeEM: EM update not provided by all "
+                << "models" << std::endl;
+      exit(1);
+   }
+
+   // Sync parameters
+   SyncFitParameters(resetFitStartValue);
+
+   // Start from the parameters stored in minuit. The update keeps the rates
+   // positive, hence negative lower bounds are not supported
+   const std::size_t nPar = fParTable.size();
+   std::vector<double> x, lower, upper, error;
+   GetMinuitParameters(x, lower, upper, error);
+   for (std::size_t d = 0; d < nPar; d++) {
+      if (std::isinf(lower[d])) lower[d] = 0.0;
+      if (lower[d] < 0) {
+         std::cerr << "MSMinimizer::MinimizeEM: parameter \"" 
+                   << fParTable[d]->GetName() << "\" not bounded to "
+                   << "non-negative values" << std::endl;
+         exit(1);
+      }
+   }
+
+   // Each iteration evaluates the NLL and the terms of the majorizing
+   // function at x, and moves x to its minimum. The iterations converge
+   // linearly, hence the distance from the minimum is estimated from the 
+   // ratio r of the last two decreases of the NLL: edm = delta*r/(1-r)
+   std::vector<double> logTerm(nPar), linTerm(nPar), quadTerm(nPar);
+   const double edmMax = 0.001*fMinuitTollerance*fMinuit->fUp;
+   double nll = 0.0, delta = 0.0;
+   fEDM = std::numeric_limits<double>::infinity();
+   fMinuitErrorFlag = 4;
+   for (int iter = 0; ; iter++) {
+      std::fill(logTerm.begin(), logTerm.end(), 0.0);
+      std::fill(linTerm.begin(), linTerm.end(), 0.0);
+      std::fill(quadTerm.begin(), quadTerm.end(), 0.0);
+      double newNLL = 0.0;
+      for (std::size_t i = 0; i < fModelVector->size(); i++) 
+         newNLL += fModelVector->at(i)->NLogLikelihoodEM(x.data(), 
+               logTerm.data(), linTerm.data(), quadTerm.data()) - 
+               fModelNLLOffset[i];
+
+      if (iter > 0) {
+         const double newDelta = nll - newNLL;
+         if (iter > 1 && newDelta >= 0 && newDelta < delta) 
+            fEDM = newDelta * newDelta / (delta - newDelta);
+         else
+            fEDM = std::fabs(newDelta);
+         delta = newDelta;
+      }
+      nll = newNLL;
+      if (iter > 1 && fEDM < edmMax) {
+         fMinuitErrorFlag = 0;
+         break;
+      }
+      if (iter + 1 >= fMinuitMaxCalls) break;
+
+      // Minimum of 0.5*quad*x^2 + lin*x - log*ln(x) within the bounds. 
+      // The root is written in the form free of cancellations
+      for (std::size_t d = 0; d < nPar; d++) {
+         if (lower[d] == upper[d]) continue;
+         const double q = quadTerm[d], l = linTerm[d], n = logTerm[d];
+         double value = x[d];
+         if (q > 0) {
+            const double root = sqrt(l*l + 4.0*q*n);
+            value = l > 0 ? 2.0*n/(l + root) : (root - l)/(2.0*q);
+         } else if (l > 0) {
+            value = n/l;
+         } else if (n > 0 && std::isfinite(upper[d])) {
+            value = upper[d];
+         }
+         x[d] = std::min(std::max(value, lower[d]), upper[d]);
+      }
+   }
+
+   if (GetMinuitStatus()) fNMinuitFails++;
+
+   // The curvature of the majorizing function at the minimum (log/x^2 + 
+   // quad) gives a rough estimate of the errors
+   for (std::size_t d = 0; d < nPar; d++) {
+      const double curvature = (x[d] > 0 ? logTerm[d]/(x[d]*x[d]) : 0.0) + quadTerm[d];
+      if (curvature > 0) error[d] = sqrt(2.0*fMinuit->fUp/curvature);
+   }
+   SetMinuitParameters(x, error);
+
+   fMinNLL = nll;
+   // approximation only, not accurate
+   fCovQual = 1;
+}
+
+void MSMinimizer::BuildModelBatches()
+{
+   fModelBatches.clear();
+
+   // Start from the most expensive models
+   const std::size_t nModels = fModelVector->size();
+   std::vector<std::size_t> order(nModels);
+   std::iota(order.begin(), order.end(), 0);
+   std::stable_sort(order.begin(), order.end(), 
+         [this] (std::size_t a, std::size_t b) {
+            return fModelVector->at(a)->GetEvaluationCost() > 
+                   fModelVector->at(b)->GetEvaluationCost();
+         });
+
+   // Models that are not thread safe are evaluated by the same thread.
+   // Expensive models get their own thread, cheap models (e.g. pulls) are
+   // grouped until the batch reaches kMinBatchCost
+   std::vector<std::size_t> serialBatch, cheapBatch;
+   double cheapBatchCost = 0.0;
+   for (const auto& i : order) {
+      const MSModel* model = fModelVector->at(i);
+      const double cost = model->GetEvaluationCost();
+      if (!model->IsThreadSafe()) {
+         serialBatch.push_back(i);
+      } else if (cost >= kMinBatchCost) {
+         fModelBatches.push_back(std::vector<std::size_t>(1, i));
+      } else {
+         cheapBatch.push_back(i);
+         cheapBatchCost += cost;
+         if (cheapBatchCost >= kMinBatchCost) {
+            fModelBatches.push_back(cheapBatch);
+            cheapBatch.clear();
+            cheapBatchCost = 0.0;
+         }
+      }
+   }
+   if (!serialBatch.empty()) fModelBatches.insert(fModelBatches.begin(), serialBatch);
+   if (!cheapBatch.empty())  fModelBatches.push_back(cheapBatch);
+}
+
+double MSMinimizer::EvaluateModels(double* par, double* grad)
+{
+   const std::size_t nPar = fGlobalParMap->size();
+   const std::size_t nModels = fModelVector->size();
+   if (grad) std::fill(grad, grad + nPar, 0.0);
+   // The offsets are subtracted model by model, before the sum
+
+   // Serial loop over the models. Each model can use the pool on its bins
+   if (!fThreadPool || fModelBatches.size() < fThreadPool->GetNThreads()) {
+      double nll = 0.0;
+      for (std::size_t i = 0; i < nModels; i++) {
+         MSModel* model = fModelVector->at(i);
+         nll += (grad ? model->NLogLikelihoodGradient(par, grad) 
+                      : model->NLogLikelihood(par)) - fModelNLLOffset[i];
+      }
+      return nll;
+   }
+
+   // Evaluate the batches of models in parallel. Each model writes its own
+   // NLL and gradient, which are then summed in the order of the models such
+   // that the result is the same as for the serial loop
+   fModelNLL.assign(nModels, 0.0);
+   if (grad) fModelGradient.assign(nModels*nPar, 0.0);
+   fThreadPool->ParallelFor(fModelBatches.size(), [&] (std::size_t b) {
+      for (const auto& i : fModelBatches[b]) {
+         MSModel* model = fModelVector->at(i);
+         fModelNLL[i] = grad ? model->NLogLikelihoodGradient(par, &fModelGradient[i*nPar])
+                             : model->NLogLikelihood(par);
+      }
+   });
+
+   double nll = 0.0;
+   for (std::size_t i = 0; i < nModels; i++) {
+      nll += fModelNLL[i] - fModelNLLOffset[i];
+      if (grad)
+         for (std::size_t p = 0; p < nPar; p++) grad[p] += fModelGradient[i*nPar + p];
+   }
+   return nll;
+}
+
+void MSMinimizer::FCNNLLLikelihood(int & /*npar*/, double * grad,
+      double &fval, double * par, int flag)
+{
+   MSMinimizer* minimizer = gCurrentMinimizer;
+   if (minimizer == nullptr) {
+      std::cerr << "MSMinimizer::FCNNLLLikelihood: minuit called outside of "
+                << "MSMinimizer (use MSMinimizer::Minimize)" << std::endl;
+      exit(1);
+   }
+
+   // convert the parameters to the original units
+   double* externalPar = par;
+   const std::size_t nPar = minimizer->fParTable.size();
+   if (minimizer->fParTransformed) {
+      minimizer->fExternalPar.resize(nPar);
+      for (std::size_t d = 0; d < nPar; d++) 
+         minimizer->fExternalPar[d] = minimizer->ToExternal(d, par[d]);
+      externalPar = minimizer->fExternalPar.data();
+   }
+
+   // minuit requests the derivatives with flag 2 (user-gradient mode only)
+   if (flag == 2 && grad && minimizer->fMinuitGradient) {
+      fval = minimizer->EvaluateModels(externalPar, grad);
+      if (minimizer->fParTransformed) 
+         for (std::size_t d = 0; d < nPar; d++) 
+            grad[d] *= minimizer->GetTransformDerivative(d, par[d]);
+   } else {
+      fval = minimizer->EvaluateModels(externalPar, nullptr);
+   }
 }
 
 } // namespace mst
@@ -23,18 +23,30 @@
  * \details 
  * Class handling the interface betweeen models and minimizer.
  *
+ * Each instance owns its map of parameters, to which the models are bound
+ * when added (see MSModel::BindParameterMap), and its own instance of
+ * TMinuit. The FCN evaluates the models of the minimizer running on the
+ * calling thread, such that independent minimizers can be used concurrently
+ * from different threads.
+ *
  * \author Matteo Agostini
  */
 
 #ifndef MST_MSMinimizer_H
 #define MST_MSMinimizer_H
 
+// c/c++ libs
+#include <cmath>
+#include <functional>
+
 // ROOT libs
+#include <TMatrixDSym.h>
 #include <TMinuit.h>
 
 // m-stats libs
 #include "MSModel.h"
 #include "MSObject.h"
+#include "MSThreadPool.h"
 
 namespace mst {
 
@@ -43,6 +55,8 @@ class MSMinimizer : public MSObject
    public:
       //! Type defining a vector of Models used as class member
       using MSModelVector = std::vector<MSModel*>;
+      //! Fit procedure run on each start of a multi-start fit
+      using MSFitProcedure = std::function<void(MSMinimizer*)>;
 
    public:
       //! Constructor
@@ -50,8 +64,23 @@ class MSMinimizer : public MSObject
       //! Desstructor
       virtual ~MSMinimizer();
 
-      //! Add model (the function does NOT take ownership of the object
-      void AddModel(MSModel* model) { fModelVector->push_back(model); }
+      //! Get a copy of the minimizer with clones of all models (see
+      //! MSModel::Clone) bound to a copy of the parameter map. The copy has
+      //! the same settings (minuit tolerance and max calls, gradient, 
+      //! scaling, NLL offset) and status of the last minimization, but no
+      //! thread pool and its own instance of minuit, such that the two can be
+      //! used concurrently. The clones must be created serially, as they 
+      //! copy the ROOT objects of the models. Return nullptr if a model 
+      //! cannot be cloned
+      MSMinimizer* Clone() const;
+
+      //! Add model (the function does NOT take ownership of the object).
+      //! The model is bound to the parameter map of the minimizer
+      void AddModel(MSModel* model) { 
+         model->BindParameterMap(fGlobalParMap);
+         model->SetThreadPool(fThreadPool);
+         fModelVector->push_back(model); 
+      }
       //! Get the number of models added to the minimizer
       unsigned int GetNModels() const { return fModelVector->size(); }
 
@@ -70,6 +99,10 @@ class MSMinimizer : public MSObject
          return it != fGlobalParMap->end() ? it->second : 0;
       }
 
+      //! Get the table of parameters indexed as the Minuit array (synced with
+      //! last SyncFitParameters call, the minimizer keeps ownership of the obj!)
+      const std::vector<MSParameter*>& GetParameterTable() const { return fParTable; }
+
       //! Print summary of the parameters
       void PrintParSummary() const {
          for (const auto& it : *fGlobalParMap) it.second->PrintSummary();
@@ -92,7 +125,104 @@ class MSMinimizer : public MSObject
       //! Set minuit tolerance
       void SetMinuitTolerance (double tolerance) { fMinuitTollerance = tolerance; }
 
-      //! Get the pointer to minuit
+      //! Enable/disable the analytic gradient. The gradient is passed to
+      //! minuit only if all models provide it (default: true)
+      void SetUseGradient (bool useGradient) { fUseGradient = useGradient; }
+
+      //! Check whether the gradient is computed analytically
+      bool HasGradient() const;
+
+      //! Check whether all models provide the analytic Hessian
+      bool HasHessian() const;
+
+      //! Check whether all models provide the terms of the EM update
+      bool HasEMTerms() const;
+
+      //! Compute the covariance matrix from the analytic Hessian of the NLL at
+      //! the best fit point of the last minimization (no NLL evaluations).
+      //! Optionally, the matrix is handed to minuit as covariance matrix: the
+      //! errors of the parameters are updated and the matrix is used as
+      //! starting point for the next minimization. The matrix is written in
+      //! the internal arrays of minuit and flagged as full accurate (covariance
+      //! quality 3) without minuit's checks of positive definiteness.
+      //! Return false if the Hessian is not available or not invertible, or
+      //! if minuit is not synced with the parameters (the covariance and the
+      //! errors of the parameters are updated anyway)
+      bool ComputeCovariance(bool updateMinuit = false);
+
+      //! Get the covariance matrix (synced with last ComputeCovariance call)
+      //! Rows follow the order of the global parameter map. The entries of 
+      //! fixed parameters are null
+      const TMatrixDSym& GetCovariance() const { return fCovariance; }
+
+      //! Get the correlation matrix (synced with last ComputeCovariance call)
+      TMatrixDSym GetCorrelation() const;
+
+      //! Compare the errors of the free parameters with those computed by
+      //! minuit's HESSE at the best fit point (run on a clone). Return false
+      //! and print the parameters whose relative difference exceeds the
+      //! tolerance. Errors of parameters close to a bound of their range are
+      //! expected to differ because of the minuit transformation
+      bool CheckCovariance(double tolerance = 0.01) const;
+
+      //! Set the number of threads used to evaluate the NLL (0: number of
+      //! hardware threads, 1: serial evaluation). The pool of threads is 
+      //! owned by the minimizer and shared with all models. If there are at
+      //! least as many batches of models as threads, the models are evaluated
+      //! concurrently, otherwise each model is evaluated in parallel over its
+      //! bins
+      void SetNThreads (unsigned int nThreads);
+
+      //! Get the number of threads used to evaluate the NLL
+      unsigned int GetNThreads() const;
+      //! Get the thread pool (null if single threaded). It can be used to
+      //! run tasks on clones of the minimizer while this one is idle
+      MSThreadPool* GetThreadPool() const { return fThreadPool; }
+
+      //! Enable/disable the rescaling of the parameters passed to minuit. 
+      //! Minuit works on u = x/scale, where the scale is the uncertainty of
+      //! the parameter estimated from the diagonal of the Hessian (analytic
+      //! or numerical) at the start values, such that all parameters have
+      //! unit uncertainty. If logTransform is true, the parameters with a
+      //! positive lower bound (e.g. rates) are passed as u = ln(x)/scale.
+      //! The scales are computed when minuit is (re)initialized. The values
+      //! and errors of the parameters are always given in the original units
+      void SetParameterScaling(bool scaling = true, bool logTransform = false) {
+         fParScaling = scaling;
+         fParLogTransform = logTransform;
+         fMinuitSynced = false;
+      }
+      //! Get the scale of the parameters (synced with last SyncFitParameters
+      //! call, same order of the parameter table)
+      const std::vector<double>& GetParameterScales() const { return fParScale; }
+
+      //! Set the constant subtracted from the NLL of each model during the
+      //! minimization, such that minuit works on values of order one 
+      //! instead of the large absolute NLL of data sets with many counts:
+      //!  - "none": no offset (default)
+      //!  - "saturated": NLL of the saturated model (see 
+      //!    MSModel::GetSaturatedNLL), i.e. the minimizer works on half the
+      //!    deviance
+      //!  - "start": NLL at the start values of the parameters, recomputed 
+      //!    each time the start values are synced with minuit
+      //! The position of the minimum and the NLL differences are unchanged
+      void SetNLLOffset(const std::string& mode);
+      //! Get the sum of the offsets subtracted from the NLL of the models
+      //! (synced with last SyncFitParameters call)
+      double GetNLLOffset() const { return fNLLOffset; }
+
+      //! Set the start values of the free parameters to the solution of the
+      //! weighted least squares fit of the data sets (see 
+      //! MSModel::HasLeastSquaresTerms), bounded by the parameter ranges and
+      //! non-negative if the range has no lower edge. The fixed parameters,
+      //! and those on which models without least squares terms depend (e.g.
+      //! pulls), keep their start value. Return false if no parameter could
+      //! be set
+      bool SetFitStartValuesFromLeastSquares();
+
+      //! Get the pointer to minuit. The commands evaluating the NLL (e.g.
+      //! MIGRAD or HESSE) must be run through Minimize: the FCN exits with an
+      //! error if it is called directly
       TMinuit* GetMinuit() const { return fMinuit;}
 
       //! Sync parameter info from the model to minuit
@@ -101,7 +231,13 @@ class MSMinimizer : public MSObject
       //! previous interatoin
       void SyncFitParameters(bool resetFitStartValue  = true);
 
-      //! Call the minimizer
+      //! Call the minimizer. Besides the minuit commands (e.g. "MIGRAD"), the
+      //! method "LBFGSB" runs the native bounded L-BFGS minimizer (see
+      //! MSLBFGSB), which uses the analytic gradient if provided by all
+      //! models and numerical derivatives otherwise. The method "EM" runs the
+      //! EM (multiplicative) update, available if all models provide it (see
+      //! MSModel::HasEMTerms). The best fit point of the native methods is
+      //! then passed to minuit as starting point for the next step
       void Minimize(const std::string& minimizer = "MINIMIZE", 
                     bool resetFitStartValue = true);
       
@@ -113,14 +249,46 @@ class MSMinimizer : public MSObject
          Minimize(minimizer, resetFitStartValue);
       }
 
+      //! Set the number of starts of MinimizeMultiStart (default: 1)
+      void SetNMultiStarts(unsigned int nStarts) { fNMultiStarts = nStarts; }
+      //! Get the number of starts of MinimizeMultiStart
+      unsigned int GetNMultiStarts() const { return fNMultiStarts; }
+      //! Set the maximum NLL difference of the starts that agree with the 
+      //! best minimum (default: 0.01)
+      void SetMultiStartTolerance(double deltaNLL) { fMultiStartTolerance = deltaNLL; }
+
+      //! Run the fit procedure on clones of the minimizer (see Clone) from
+      //! different start values and keep the best converged minimum. The
+      //! first start uses the current start values, the others the points
+      //! of a Sobol sequence spanning the range of the free parameters 
+      //! (parameters without range keep their start value). The starts are
+      //! run concurrently on the thread pool of the minimizer, if any. The
+      //! best fit values, the minimum and the minuit status of the best 
+      //! start are stored in this minimizer, and the best fit values are
+      //! passed to minuit as starting point of the next steps
+      void MinimizeMultiStart(const MSFitProcedure& fit);
+      //! Same as above with a single call of Minimize(minimizer)
+      void MinimizeMultiStart(const std::string& minimizer = "MINIMIZE") {
+         MinimizeMultiStart([&minimizer] (MSMinimizer* m) { m->Minimize(minimizer); });
+      }
+      //! Get the number of starts of the last multi-start fit whose minimum
+      //! agrees with the best one within the tolerance (0 if the best start
+      //! did not converge)
+      unsigned int GetNStartsAgree() const { return fNStartsAgree; }
+      //! Get the number of converged starts of the last multi-start fit
+      unsigned int GetNStartsConverged() const { return fNStartsConverged; }
+
       //! Get output status after minuit last call
       int GetMinuitStatus() const { return fMinuitErrorFlag; }
 
       //! Get output status after minuit last call
       int GetNMinuitFails() const { return fNMinuitFails; }
 
-      //! Get NLL minimum (synced with last migrad call)
-      double GetMinNLL() const { return fMinNLL; }
+      //! Get NLL minimum (synced with last migrad call). If absolute is
+      //! false, the offset set with SetNLLOffset is not added back
+      double GetMinNLL(bool absolute = true) const { 
+         return absolute ? fMinNLL + fNLLOffset : fMinNLL;
+      }
 
       //! Get estimated vertical distance from minimum
       //!  (synced with last migrad call)
@@ -135,16 +303,98 @@ class MSMinimizer : public MSObject
       static void  FCNNLLLikelihood(int& npar, double* grad, double& fval,
             double* par, int flag);
 
+      //! Minimum cost (see MSModel::GetEvaluationCost) of a batch of models
+      //! evaluated by the same thread. Cheaper models are grouped together
+      static constexpr double kMinBatchCost = 4096;
+
    private:
-      //! Global pointer for using FCNNLLLikelihood as Minuit FCN
-      static MSMinimizer* global_pointer;
+      //! Group the models in batches evaluated by the same thread
+      void BuildModelBatches();
+      //! Sum the NLL of all models and, if grad is not null, fill the gradient
+      double EvaluateModels(double* par, double* grad);
+      //! Get the parameters stored in minuit (start values or best fit of the
+      //! previous step) with their bounds and errors. The bounds of the fixed
+      //! parameters coincide with their value. Return the number of free
+      //! parameters
+      int GetMinuitParameters(std::vector<double>& x, std::vector<double>& lower,
+                              std::vector<double>& upper,
+                              std::vector<double>& error);
+      //! Store the best fit values and errors found by a native minimizer 
+      //! and pass the values to minuit
+      void SetMinuitParameters(const std::vector<double>& x, 
+                               const std::vector<double>& error);
+      //! Compute the scales of the parameters at their start values
+      void ComputeParameterScales();
+      //! Define the parameter d in minuit (transformed start value, step and
+      //! range)
+      void DefineMinuitParameter(int d, const MSParameter* par);
+      //! Convert the minuit parameter d to the original units
+      double ToExternal(std::size_t d, double u) const {
+         return fParLog[d] ? exp(fParScale[d]*u) : fParScale[d]*u;
+      }
+      //! Convert the parameter d to the units of minuit
+      double ToInternal(std::size_t d, double x) const {
+         return fParLog[d] ? log(x)/fParScale[d] : x/fParScale[d];
+      }
+      //! Derivative dx/du of the parameter d 
+      double GetTransformDerivative(std::size_t d, double u) const {
+         return fParLog[d] ? fParScale[d]*ToExternal(d, u) : fParScale[d];
+      }
+      //! Compute the offset subtracted from the NLL of each model
+      void ComputeNLLOffsets();
+      //! Minimize the NLL with MSLBFGSB
+      void MinimizeLBFGSB(bool resetFitStartValue);
+      //! Minimize the NLL with the EM update
+      void MinimizeEM(bool resetFitStartValue);
 
+   private:
       //! Pointer to the model
       MSModelVector* fModelVector {nullptr};
-      //! Pointer to the global parameter map
+      //! Pointer to the global parameter map (owned by the minimizer)
       MSParameterMap* fGlobalParMap {nullptr};
       //! Pointer to a local copy of the parameter map
       MSParameterMap* fLocalParMap {nullptr};
+      //! Parameters of the global map indexed as the Minuit array
+      std::vector<MSParameter*> fParTable;
+
+      //! Pool of threads used to evaluate the NLL
+      MSThreadPool* fThreadPool {nullptr};
+      //! Batches of models (indexes in fModelVector) evaluated by one thread
+      std::vector<std::vector<std::size_t>> fModelBatches;
+      //! NLL of each model (parallel evaluation)
+      std::vector<double> fModelNLL;
+      //! Gradient of each model (parallel evaluation)
+      std::vector<double> fModelGradient;
+
+      //! Rescale the parameters passed to minuit
+      bool fParScaling {false};
+      //! Pass the parameters with positive lower bound in logarithmic scale
+      bool fParLogTransform {false};
+      //! Flag set if minuit works on transformed parameters
+      bool fParTransformed {false};
+      //! Scale of each parameter of the table
+      std::vector<double> fParScale;
+      //! Flag of the parameters passed in logarithmic scale
+      std::vector<bool> fParLog;
+      //! Parameters in the original units (FCN of transformed parameters)
+      std::vector<double> fExternalPar;
+
+      //! Number of starts of the multi-start fit
+      unsigned int fNMultiStarts {1};
+      //! Maximum NLL difference of the starts agreeing with the best one
+      double fMultiStartTolerance {0.01};
+      //! Number of starts agreeing with the best one (last multi-start fit)
+      unsigned int fNStartsAgree {0};
+      //! Number of converged starts (last multi-start fit)
+      unsigned int fNStartsConverged {0};
+
+      //! Mode of the offset subtracted from the NLL ("none", "saturated", 
+      //! "start")
+      std::string fNLLOffsetMode {"none"};
+      //! Offset subtracted from the NLL of each model
+      std::vector<double> fModelNLLOffset;
+      //! Sum of the offsets of all models
+      double fNLLOffset {0.0};
 
       //! Pointer to minuit
       TMinuit* fMinuit {nullptr};
@@ -161,7 +411,14 @@ class MSMinimizer : public MSObject
       //! Tolerance on the maximum error during minimization
       double fMinuitTollerance {1e-6};
 
-      //! Minimum of the negative log likelihood function
+      //! Use the analytic gradient if provided by all models
+      bool fUseGradient {true};
+      //! Minuit is running in user-gradient mode (SET GRAD)
+      bool fMinuitGradient {false};
+      //! All parameters have been synced with the current minuit instance
+      bool fMinuitSynced {false};
+
+      //! Minimum of the negative log likelihood function, without offset
       //! Synced with mnstat-fmin
       //!    "the best function value found so far"
       double fMinNLL {0.0};
@@ -179,6 +436,9 @@ class MSMinimizer : public MSObject
       //!     2 = full matrix, but forced positive-definite
       //!     3 = full accurate covariance matrix
       int fCovQual {0};
+
+      //! Covariance matrix computed from the analytic Hessian
+      TMatrixDSym fCovariance;
 };
 
 } // namespace mst
@@ -22,25 +22,72 @@
 
 namespace mst {
 
-MSParameterMap* MSModel::fParameters = 0;
+std::mutex MSModel::fParametersMutex;
 
 MSModel::MSModel(const std::string& name) : MSObject(name)
 {
-   if (!fParameters) fParameters = new MSParameterMap();
+   fParameters = GetDefaultParameterMap();
    fParNameList = new std::vector<std::string>;
 }
 
-MSModel::~MSModel()
+MSModel::MSModel(const MSModel& other) : MSObject(other),
+   fParameters(other.fParameters), 
+   fParNameList(new std::vector<std::string>(*other.fParNameList)),
+   fParIndex(other.fParIndex),
+   fExposure(other.fExposure)
 {
-   if (fParameters != nullptr) {
-      for (auto& it : *fParameters) delete it.second;
-      fParameters->clear();
-      delete fParameters;
-   }
+}
 
+MSModel::~MSModel()
+{
+   // the parameters are owned by the map
    delete fParNameList;
 }
 
+MSParameterMap* MSModel::GetDefaultParameterMap()
+{
+   static MSParameterMap* defaultMap = new MSParameterMap();
+   return defaultMap;
+}
+
+void MSModel::BindParameterMap(MSParameterMap* parameters)
+{
+   if (!parameters) {
+      std::cerr << "MSModel::BindParameterMap: null MSParameterMap pointer"
+                << std::endl;
+      exit(1);
+   }
+   if (parameters == fParameters) return;
+
+   std::lock_guard<std::mutex> lock(fParametersMutex);
+   const bool fromDefaultMap = fParameters == GetDefaultParameterMap();
+   for (const auto& name : *fParNameList) {
+      MSParameterMap::iterator it = fParameters->find(GetGlobalName(name, true));
+      if (it == fParameters->end()) it = fParameters->find(GetGlobalName(name, false));
+      const bool isInNewMap = 
+         parameters->find(GetGlobalName(name, true))  != parameters->end() ||
+         parameters->find(GetGlobalName(name, false)) != parameters->end();
+
+      if (it == fParameters->end()) {
+         // global parameter shared with a model already bound to the new map
+         if (isInNewMap) continue;
+         std::cerr << "MSModel::BindParameterMap: parameter \""
+                   << name << "\" not found" << std::endl;
+         exit(1);
+      } else if (!isInNewMap) {
+         parameters->insert(*it);
+         fParameters->erase(it);
+      } else if (fromDefaultMap) {
+         // the parameter was already moved by another model: discard the
+         // duplicate, as done by AddParameter for global parameters
+         delete it->second;
+         fParameters->erase(it);
+      }
+   }
+   fParameters = parameters;
+   fResolvedMapSize = 0;
+}
+
 void MSModel::AddParameter(MSParameter* par)
 {
    if(!par){
@@ -67,6 +114,7 @@ void MSModel::AddParameter(MSParameter* par)
       // model. Before searching build and apply the global name
       par->SetName( GetGlobalName(par->GetName(), par->IsGlobal()));
 
+      std::lock_guard<std::mutex> lock(fParametersMutex);
       if(fParameters->find(par->GetName()) == fParameters->end()) {
          fParameters->insert(MSParameterPair(par->GetName(),par));
       } else {
@@ -102,6 +150,14 @@ MSParameter* MSModel::GetParameter(const std::string& localName)  const
    return it->second;
 }
 
+void MSModel::ResolveParameters()
+{
+   fParIndex.resize(fParNameList->size());
+   for (std::size_t k = 0; k < fParNameList->size(); k++)
+      fParIndex[k] = GetParameterIndex(fParNameList->at(k));
+   fResolvedMapSize = fParameters->size();
+}
+
 unsigned int MSModel::GetParameterIndex(const std::string& localName) const
 {
    MSParameterMap::const_iterator it = GetParameterIterator(localName);
@@ -34,6 +34,7 @@
 #define MST_MSModel_H
 
 // c/c++ libs
+#include <mutex>
 #include <vector>
 
 // m-stats libs
@@ -42,6 +43,8 @@
 
 namespace mst {
 
+class MSThreadPool;
+
 class MSModel : public MSObject
 {
    public:
@@ -49,11 +52,34 @@ class MSModel : public MSObject
       MSModel(const std::string& name = "");
       //! Destructor
       virtual ~MSModel();
+      //! Assignment operator (disabled)
+      MSModel& operator=(const MSModel&) = delete;
+
+      //! Get a copy of the model, independent of the original one such that
+      //! the two can be evaluated concurrently (nullptr if not supported). 
+      //! The copy refers to the parameter map of the original model until
+      //! it is bound to a new one (see BindParameterMap) and does not use
+      //! any thread pool
+      virtual MSModel* Clone() const { return nullptr; }
+
+   protected:
+      //! Copy constructor used by Clone
+      MSModel(const MSModel& other);
 
     //
     // Parameters:
     //
    public:
+      //! Bind the model to a map of parameters (the function does NOT take
+      //! ownership of the object). The parameters registered by the model are
+      //! moved from the current map to the new one, unless already present
+      //! (e.g. global parameters moved by another model). Models sharing 
+      //! global parameters should be bound to the same map
+      void BindParameterMap(MSParameterMap* parameters);
+      //! Get the map of parameters used by the models not bound to a specific
+      //! map (the map is never deleted)
+      static MSParameterMap* GetDefaultParameterMap();
+
       //! Get pointer to the vector of parameters
       MSParameterMap* GetParameters() { return fParameters; }
       //! Get pointer to the vector of parameters
@@ -67,6 +93,17 @@ class MSModel : public MSObject
       //! Get the vector of parameters registered by an instance of the class
       const std::vector<std::string>* GetLocalParameters() const { return fParNameList; }
 
+      //! Resolve the indexes in the Minuit array of the parameters used by the
+      //! model, such that the NLL evaluation does not need any string lookup.
+      //! Called by MSMinimizer::SyncFitParameters and, if the global map has
+      //! changed in the meanwhile, at the next evaluation of the NLL
+      virtual void ResolveParameters();
+      //! Check if the resolved indexes are in sync with the global map
+      bool IsResolved() const { 
+         return fResolvedMapSize != 0 && fResolvedMapSize == fParameters->size() 
+                && fParIndex.size() == fParNameList->size();
+      }
+
    protected:
       //! Get iterator over a parameter
       MSParameterMap::iterator GetParameterIterator(const std::string& localName) const;
@@ -76,6 +113,11 @@ class MSModel : public MSObject
        double GetMinuitParameter(double* par, const std::string& localName) const {
           return par[GetParameterIndex(localName)];
        }
+      //! Get parameter value from Minuit array using the position of the 
+      //! parameter in fParNameList (requires resolved indexes)
+       double GetMinuitParameter(double* par, std::size_t k) const {
+          return par[fParIndex[k]];
+       }
       //! Get the local/global name  (the format is {global:local}.name)
       std::string GetGlobalName (const std::string& name, bool isGlobal = false) const {
          return (isGlobal ? "global" : GetName()) + "." + name;
@@ -90,6 +132,65 @@ class MSModel : public MSObject
 
       //! Virtual function returning the NLogLikelihood function
       virtual double NLogLikelihood(double* parameters) = 0;
+      //! NLL of the saturated model, i.e. of a model reproducing exactly the
+      //! data set (e.g. expectation equal to the counts in each bin). The
+      //! difference with NLogLikelihood is half of the deviance. Models
+      //! without a natural saturated model return 0
+      virtual double GetSaturatedNLL() const { return 0.0; }
+
+      //! Estimated cost of an NLL evaluation (arbitrary units, roughly the
+      //! number of bins times the number of components). Used to balance the
+      //! parallel evaluation of the models
+      virtual double GetEvaluationCost() const { return 1.0; }
+      //! Check if the NLL can be evaluated concurrently with other models,
+      //! i.e. it does not modify objects shared with other models (e.g. the
+      //! global state of ROOT)
+      virtual bool IsThreadSafe() const { return true; }
+
+      //! Check if the model provides the analytic gradient of the NLL
+      virtual bool HasGradient() const { return false; }
+      //! Return the NLL and add its derivatives with respect to the Minuit
+      //! parameters to grad (one entry for each parameter in the global map).
+      //! Models without analytic gradient leave grad unchanged
+      virtual double NLogLikelihoodGradient(double* parameters, double* /*grad*/) {
+         return NLogLikelihood(parameters);
+      }
+
+      //! Check if the model provides the analytic Hessian of the NLL
+      virtual bool HasHessian() const { return false; }
+      //! Add the second derivatives of the NLL with respect to the Minuit 
+      //! parameters to hess (row-major square matrix with one row for each
+      //! parameter in the global map)
+      virtual void NLogLikelihoodHessian(double* /*parameters*/, double* /*hess*/) {}
+
+      //! Check if the model provides the terms of the EM (multiplicative)
+      //! update, i.e. the NLL is a Poisson likelihood of non-negative rates
+      //! times non-negative templates or a penalty at most quadratic in the
+      //! parameters
+      virtual bool HasEMTerms() const { return false; }
+      //! Return the NLL and add to the arrays (one entry for each parameter 
+      //! in the global map) the coefficients of a separable function lying
+      //! above the NLL and touching it at par (up to a constant):
+      //!    sum_i 0.5*quad_i*x_i^2 + lin_i*x_i - log_i*ln(x_i)
+      //! The EM update minimizes the sum of these functions over all models
+      virtual double NLogLikelihoodEM(double* parameters, double* /*logTerm*/,
+                                      double* /*linTerm*/, double* /*quadTerm*/) {
+         return NLogLikelihood(parameters);
+      }
+
+      //! Check if the model provides the normal equations of a weighted least
+      //! squares fit of its data set (see AddLeastSquaresTerms)
+      virtual bool HasLeastSquaresTerms() const { return false; }
+      //! Add the normal equations of the weighted least squares fit of the
+      //! data set to matrix (row-major square matrix with one row for each
+      //! parameter in the global map) and vector. The fit minimizes
+      //! 0.5*x^T*matrix*x - vector^T*x
+      virtual void AddLeastSquaresTerms(double* /*matrix*/, double* /*vector*/) {}
+      //! Get the indexes in the Minuit array of the parameters on which the
+      //! NLL depends (requires resolved indexes)
+      virtual std::vector<unsigned int> GetParameterDependencies() const {
+         return fParIndex;
+      }
 
     //
     // Parameters of interest for the model
@@ -100,16 +201,30 @@ class MSModel : public MSObject
       //! Get the expsosure of data set
       double GetExposure () const {return fExposure;}
 
+      //! Set the pool of threads used to evaluate the NLL (the function does
+      //! NOT take ownership of the object). nullptr: serial evaluation
+      virtual void SetThreadPool (MSThreadPool* pool) { fThreadPool = pool; }
+      //! Get the pool of threads used to evaluate the NLL
+      MSThreadPool* GetThreadPool () const { return fThreadPool; }
+
     //
     // Class members
     //
    protected:
-      //! Pointer to the global map of parameters
-      static MSParameterMap* fParameters;
+      //! Pointer to the map of parameters (by default shared by all models)
+      MSParameterMap* fParameters {nullptr};
+      //! Mutex protecting the insertion of parameters in the maps
+      static std::mutex fParametersMutex;
       //! names of the parameters registered from an instance of the class
       std::vector<std::string>* fParNameList {nullptr};
+      //! Index in the Minuit array of the parameters in fParNameList
+      std::vector<unsigned int> fParIndex;
+      //! Size of the global map when the indexes were resolved (0: never)
+      std::size_t fResolvedMapSize {0};
       //! Exposure of the data set
       double fExposure {0.0};
+      //! Pool of threads used to evaluate the NLL (not owned)
+      MSThreadPool* fThreadPool {nullptr};
 };
 
 // Templated class inheriting from MSModel to handle a data set and pdfBuilder
@@ -123,21 +238,32 @@ class MSModelT: public MSModel {
       MSModelT(const std::string& name = ""): MSModel(name) {}
       //! Destructor
       virtual ~MSModelT() { delete fDataSet; delete fPDFBuilder;}
-
       //! Virtual function from MSModel to be overloaded in the concrete class
       virtual double NLogLikelihood(double* par) override = 0;
 
       //! Set data set and delete the one previsouly set
-      void SetDataSet(TData* dataSet) { delete fDataSet; fDataSet = dataSet; }
+      virtual void SetDataSet(TData* dataSet) { delete fDataSet; fDataSet = dataSet; }
       //! Get pointer to the data set
       const TData* GetDataSet() const { return fDataSet; }
+      //! Remove the data set from the model and return it. The ownership
+      //! is passed to the caller (e.g. to refill the object and set it back)
+      virtual TData* ReleaseDataSet() {
+         TData* dataSet = const_cast<TData*>(fDataSet);
+         fDataSet = nullptr;
+         return dataSet;
+      }
 
       //! Set pdf builder and delete the one previsouly set
-      void SetPDFBuilder(TPDF* pdf) {delete fPDFBuilder; fPDFBuilder = pdf;}
+      virtual void SetPDFBuilder(TPDF* pdf) {delete fPDFBuilder; fPDFBuilder = pdf;}
       //! Get the pointer to the pdf builder
       TPDF* GetPDFBuilder() const {return fPDFBuilder;}
 
    protected:
+      //! Copy constructor cloning data set and pdf builder
+      MSModelT(const MSModelT& other): MSModel(other), 
+         fDataSet(other.fDataSet ? static_cast<TData*>(other.fDataSet->Clone()) : nullptr),
+         fPDFBuilder(other.fPDFBuilder ? new TPDF(*other.fPDFBuilder) : nullptr) {}
+
       //! pointer to the data set 
       const TData* fDataSet {nullptr}; 
       //! Pointer to PDFBuilder
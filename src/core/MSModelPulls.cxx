@@ -14,6 +14,9 @@
 // License along with this library; if not, write to the Free Software
 // Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 
+// c/c++ libs
+#include <cmath>
+
 // m-stats libs
 #include "MSMath.h"
 #include "MSModelPulls.h"
@@ -21,17 +24,74 @@
 
 namespace mst {
 
+void MSModelPull::ResolveParameters()
+{
+   MSModel::ResolveParameters();
+   fPullParIndex = GetParameterIndex(fPullPar);
+}
+
 double MSModelPullGaus::NLogLikelihood(double* par)
 {
-   const double x = GetMinuitParameter(par, fPullPar.c_str());
+   if (!IsResolved()) ResolveParameters();
+   const double x = par[fPullParIndex];
    return  (-mst::MSMath::LogGaus(x, fCentroid, fSigma));
 }
 
 
+double MSModelPullGaus::NLogLikelihoodGradient(double* par, double* grad)
+{
+   if (!IsResolved()) ResolveParameters();
+   const unsigned int i = fPullParIndex;
+   grad[i] += (par[i] - fCentroid) / (fSigma*fSigma);
+   return  (-mst::MSMath::LogGaus(par[i], fCentroid, fSigma));
+}
+
+void MSModelPullGaus::NLogLikelihoodHessian(double* /*par*/, double* hess)
+{
+   if (!IsResolved()) ResolveParameters();
+   const unsigned int i = fPullParIndex;
+   hess[i*fParameters->size() + i] += 1.0 / (fSigma*fSigma);
+}
+
+double MSModelPullGaus::NLogLikelihoodEM(double* par, double* /*logTerm*/,
+                                         double* linTerm, double* quadTerm)
+{
+   // (x-c)^2/(2 sigma^2) = 0.5*x^2/sigma^2 - x*c/sigma^2 + const
+   if (!IsResolved()) ResolveParameters();
+   const unsigned int i = fPullParIndex;
+   quadTerm[i] += 1.0 / (fSigma*fSigma);
+   linTerm[i]  -= fCentroid / (fSigma*fSigma);
+   return  (-mst::MSMath::LogGaus(par[i], fCentroid, fSigma));
+}
+
 double MSModelPullExp::NLogLikelihood(double* par)
 {
-   const double x = GetMinuitParameter(par, fPullPar.c_str());
+   if (!IsResolved()) ResolveParameters();
+   const double x = par[fPullParIndex];
    return  (-mst::MSMath::LogExp(x,fLimit, fQuantile, fOffset));
 }
 
+double MSModelPullExp::NLogLikelihoodGradient(double* par, double* grad)
+{
+   // the NLL is linear in the parameter: -log(a) + a*(x-offset)
+   if (!IsResolved()) ResolveParameters();
+   const unsigned int i = fPullParIndex;
+   grad[i] += -log(1.0-fQuantile)/(fLimit-fOffset);
+   return  (-mst::MSMath::LogExp(par[i],fLimit, fQuantile, fOffset));
+}
+
+void MSModelPullExp::NLogLikelihoodHessian(double* /*par*/, double* /*hess*/)
+{
+   // the NLL is linear in the parameter: no contribution
+}
+
+double MSModelPullExp::NLogLikelihoodEM(double* par, double* /*logTerm*/,
+                                        double* linTerm, double* /*quadTerm*/)
+{
+   if (!IsResolved()) ResolveParameters();
+   const unsigned int i = fPullParIndex;
+   linTerm[i] += -log(1.0-fQuantile)/(fLimit-fOffset);
+   return  (-mst::MSMath::LogExp(par[i],fLimit, fQuantile, fOffset));
+}
+
 } // namespace mst
@@ -47,12 +47,25 @@ class MSModelPull : public mst::MSModel
       double NLogLikelihood(double* par) override = 0;
 
       //! Set parameter to pull
-      void SetPullPar (const std::string& par) { fPullPar = par;}
+      void SetPullPar (const std::string& par) { fPullPar = par; fResolvedMapSize = 0;}
       //! Get parameter to pull
       std::string GetPullPar () const { return fPullPar;}
 
+      //! Resolve also the index of the pulled parameter
+      void ResolveParameters() override;
+      //! The NLL depends also on the pulled parameter
+      std::vector<unsigned int> GetParameterDependencies() const override {
+         std::vector<unsigned int> dependencies(fParIndex);
+         dependencies.push_back(fPullParIndex);
+         return dependencies;
+      }
+
    public:
       std::string fPullPar {""};
+
+   protected:
+      //! Index of the pulled parameter in the Minuit array
+      unsigned int fPullParIndex {0};
 };
 
 class MSModelPullGaus : public mst::MSModelPull
@@ -63,10 +76,29 @@ class MSModelPullGaus : public mst::MSModelPull
       //! Destructor
       virtual ~MSModelPullGaus() {}
 
+      //! Get a copy of the model
+      MSModelPullGaus* Clone() const override { return new MSModelPullGaus(*this); }
+
       //! function returning the negative log likelihood function to be 
       //! minimized (NLL)
       double NLogLikelihood(double* par) override;
 
+      //! The gradient of the pull is analytic
+      bool HasGradient() const override { return true; }
+      //! NLL and its gradient
+      double NLogLikelihoodGradient(double* par, double* grad) override;
+
+      //! The Hessian of the pull is analytic
+      bool HasHessian() const override { return true; }
+      //! Hessian of the NLL
+      void NLogLikelihoodHessian(double* par, double* hess) override;
+
+      //! The pull is a quadratic penalty of the EM update
+      bool HasEMTerms() const override { return true; }
+      //! NLL and its terms of the EM update
+      double NLogLikelihoodEM(double* par, double* logTerm, double* linTerm,
+                              double* quadTerm) override;
+
       //! Set centroid
       void SetCentroid (double centroid) {fCentroid = centroid;}
       //! Set sigma
@@ -90,10 +122,29 @@ class MSModelPullExp : public mst::MSModelPull
       //! Destructor
       virtual ~MSModelPullExp() {}
 
+      //! Get a copy of the model
+      MSModelPullExp* Clone() const override { return new MSModelPullExp(*this); }
+
       //! function returning the negative log likelihood function to be 
       //! minimized (NLL)
       double NLogLikelihood(double* par) override;
 
+      //! The gradient of the pull is analytic
+      bool HasGradient() const override { return true; }
+      //! NLL and its gradient
+      double NLogLikelihoodGradient(double* par, double* grad) override;
+
+      //! The Hessian of the pull is analytic
+      bool HasHessian() const override { return true; }
+      //! Hessian of the NLL
+      void NLogLikelihoodHessian(double* par, double* hess) override;
+
+      //! The pull is a linear penalty of the EM update
+      bool HasEMTerms() const override { return true; }
+      //! NLL and its terms of the EM update
+      double NLogLikelihoodEM(double* par, double* logTerm, double* linTerm,
+                              double* quadTerm) override;
+
       //! Set limit
       void SetLimit (double limit) {
          if (limit > 0) fLimit = limit;
@@ -14,19 +14,579 @@
 // License along with this library; if not, write to the Free Software
 // Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 
+// c/c++ libs
+#include <algorithm>
+#include <cmath>
+
+// ROOT libs
+#include <TMath.h>
+
 // m-stats libs
 #include "MSMath.h"
 #include "MSModelTHnBMLF.h"
+#include "MSThreadPool.h"
 
 namespace mst {
 
+namespace {
+// Check if the iterators over the in-range bins of two histograms with the
+// same binning loop over the same bins
+bool HaveSameUserRange(const THnBase* a, const THnBase* b) {
+   if (a->GetNdimensions() != b->GetNdimensions()) return false;
+   for (int d = 0; d < a->GetNdimensions(); d++) {
+      const TAxis* aa = a->GetAxis(d);
+      const TAxis* ab = b->GetAxis(d);
+      if (aa->TestBit(TAxis::kAxisRange) != ab->TestBit(TAxis::kAxisRange)) 
+         return false;
+      if (aa->TestBit(TAxis::kAxisRange) && 
+          (aa->GetFirst() != ab->GetFirst() || aa->GetLast() != ab->GetLast()))
+         return false;
+   }
+   return true;
+}
+
+// Derivative of -MSMath::LogPoisson(x, lambda) with respect to lambda
+inline double DNLogPoisson(double x, double lambda) {
+   if      (x == 0)       return 1.0;
+   else if (lambda < 899) return 1.0 - x/lambda;
+   else                   return 0.5 + 0.5/lambda - 0.5*x*x/(lambda*lambda);
+}
+
+// Second derivative of -MSMath::LogPoisson(x, lambda) with respect to lambda
+inline double D2NLogPoisson(double x, double lambda) {
+   if      (x == 0)       return 0.0;
+   else if (lambda < 899) return x/(lambda*lambda);
+   else                   return x*x/(lambda*lambda*lambda) - 0.5/(lambda*lambda);
+}
+} // anonymous namespace
+
+void MSModelTHnBMLF::SetDataSet(THnBase* dataSet)
+{
+   MSModelT::SetDataSet(dataSet);
+   if (!CompileData()) Compile();
+}
+
+THnBase* MSModelTHnBMLF::ReleaseDataSet()
+{
+   THnBase* dataSet = MSModelT::ReleaseDataSet();
+   fIsCompiled = false;
+   ResetExpectationCache();
+   return dataSet;
+}
+
+void MSModelTHnBMLF::SetPDFBuilder(MSPDFBuilderTHn* pdf)
+{
+   MSModelT::SetPDFBuilder(pdf);
+   Compile();
+}
+
+void MSModelTHnBMLF::Compile()
+{
+   fIsCompiled = false;
+   fNonNegativeTemplates = false;
+   fCompiledHistsVersion = 0;
+   ResetExpectationCache();
+   if (fDataSet == nullptr || fPDFBuilder == nullptr) return;
+
+   // collect the in-range bins of the data set. The same global bin indexes
+   // are used to read the templates
+   fBinIndex.clear();
+   auto it = fDataSet->CreateIter(kTRUE);
+   Long64_t i = 0;
+   while ((i = it->Next()) >= 0) fBinIndex.push_back(i);
+   delete it;
+
+   fNBins = fBinIndex.size();
+   fNComponents = fParNameList->size();
+   fBinStride = MSAlignedAllocator<double>::Pad(fNBins);
+
+   fData.assign(fBinStride, 0.0);
+   fDataLnGamma.assign(fBinStride, 0.0);
+   for (std::size_t j = 0; j < fNBins; j++) {
+      fData[j] = fDataSet->GetBinContent(fBinIndex[j]);
+      fDataLnGamma[j] = TMath::LnGamma(fData[j]+1.);
+   }
+
+   // fill one row of the matrix for each component
+   bool nonNegative = true;
+   auto templates = std::make_shared<MSAlignedVector<double>>(fNComponents*fBinStride, 0.0);
+   fTemplateIntegral.assign(fNComponents, 0.0);
+   for (std::size_t k = 0; k < fNComponents; k++) {
+      const THn* hist = fPDFBuilder->GetHist(fParNameList->at(k));
+      if (hist == nullptr || hist->GetNbins() != fDataSet->GetNbins()) {
+         std::cerr << "MSModelTHnBMLF::Compile: template \""
+                   << fParNameList->at(k) << "\" not found or not matching "
+                   << "the binning of the data set. Using THn evaluation\n";
+         return;
+      }
+      double* row = &(*templates)[k*fBinStride];
+      for (std::size_t j = 0; j < fNBins; j++) {
+         row[j] = hist->GetBinContent(fBinIndex[j]);
+         if (row[j] < 0) nonNegative = false;
+      }
+
+      // take the integral cached by the pdfBuilder if it runs on the same bins
+      if (HaveSameUserRange(hist, fDataSet)) {
+         fTemplateIntegral[k] = fPDFBuilder->GetHistIntegral(fParNameList->at(k));
+      } else {
+         for (std::size_t j = 0; j < fNBins; j++) fTemplateIntegral[k] += row[j];
+      }
+   }
+
+   fTemplates = templates;
+   fCompiledNTotalBins = fDataSet->GetNbins();
+   fCompiledHistsVersion = fPDFBuilder->GetHistsVersion();
+   fExpectation.assign(fBinStride, 0.0);
+   fWeight.assign(fBinStride, 0.0);
+   fParValues.assign(fNComponents, 0.0);
+   fParGradient.assign(fNComponents, 0.0);
+   fParDelta.assign(fNComponents, 0.0);
+   fBackgroundParValues.assign(fNComponents, 0.0);
+   fBackgroundValid = false;
+   fIsCompiled = true;
+   fNonNegativeTemplates = nonNegative;
+
+   if (nonNegative) CompileSparse();
+   else fIsSparse = false;
+}
+
+bool MSModelTHnBMLF::CompileData()
+{
+   if (fDataSet == nullptr || fPDFBuilder == nullptr || !fTemplates ||
+       fCompiledHistsVersion == 0 || 
+       fCompiledHistsVersion != fPDFBuilder->GetHistsVersion() ||
+       fNComponents != fParNameList->size() ||
+       fDataSet->GetNbins() != fCompiledNTotalBins) return false;
+
+   // the in-range bins must be the ones of the compiled templates
+   auto it = fDataSet->CreateIter(kTRUE);
+   Long64_t i = 0;
+   std::size_t n = 0;
+   bool sameBins = true;
+   while (sameBins && (i = it->Next()) >= 0) 
+      sameBins = n < fNBins && fBinIndex[n++] == i;
+   delete it;
+   if (!sameBins || n != fNBins) return false;
+
+   for (std::size_t j = 0; j < fNBins; j++) {
+      fData[j] = fDataSet->GetBinContent(fBinIndex[j]);
+      fDataLnGamma[j] = TMath::LnGamma(fData[j]+1.);
+   }
+
+   // the sparse arrays and the background follow the populated bins
+   if (fNonNegativeTemplates) CompileSparse();
+   fBackgroundValid = false;
+   ResetExpectationCache();
+   fIsCompiled = true;
+   return true;
+}
+
+void MSModelTHnBMLF::CompileSparse()
+{
+   fIsSparse = false;
+
+   fNSparseBins = 0;
+   for (std::size_t j = 0; j < fNBins; j++) if (fData[j] != 0) fNSparseBins++;
+   // the sparse arrays are worth only if most of the bins are empty
+   if (2*fNSparseBins > fNBins) return;
+
+   fSparseBinStride = MSAlignedAllocator<double>::Pad(fNSparseBins);
+   fSparseData.assign(fSparseBinStride, 0.0);
+   fSparseDataLnGamma.assign(fSparseBinStride, 0.0);
+   auto sparseTemplates = std::make_shared<MSAlignedVector<double>>(fNComponents*fSparseBinStride, 0.0);
+   fSparseExpectation.assign(fSparseBinStride, 0.0);
+
+   for (std::size_t j = 0, s = 0; j < fNBins; j++) {
+      if (fData[j] != 0) {
+         fSparseData[s] = fData[j];
+         fSparseDataLnGamma[s] = fDataLnGamma[j];
+         for (std::size_t k = 0; k < fNComponents; k++) 
+            (*sparseTemplates)[k*fSparseBinStride + s] = (*fTemplates)[k*fBinStride + j];
+         s++;
+      }
+   }
+   fSparseTemplates = sparseTemplates;
+   fIsSparse = true;
+}
+
+void MSModelTHnBMLF::ResolveParameters()
+{
+   MSModel::ResolveParameters();
+
+   fFreeComponents.clear();
+   fFixedComponents.clear();
+   for (std::size_t k = 0; k < fParNameList->size(); k++) {
+      if (GetParameter(fParNameList->at(k))->IsFixed()) fFixedComponents.push_back(k);
+      else                                               fFreeComponents.push_back(k);
+   }
+   fBackgroundValid = false;
+}
+
+void MSModelTHnBMLF::UpdateBackground()
+{
+   bool changed = !fBackgroundValid;
+   for (const auto& k : fFixedComponents) 
+      if (fParValues[k] != fBackgroundParValues[k]) changed = true;
+   if (!changed) return;
+
+   fBackground.assign(fBinStride, 0.0);
+   if (fIsSparse) fSparseBackground.assign(fSparseBinStride, 0.0);
+   for (const auto& k : fFixedComponents) {
+      const double par_cts = fParValues[k];
+      const double* row = &(*fTemplates)[k*fBinStride];
+      for (std::size_t j = 0; j < fNBins; j++) fBackground[j] += par_cts * row[j];
+      if (fIsSparse) {
+         const double* sparseRow = &(*fSparseTemplates)[k*fSparseBinStride];
+         for (std::size_t j = 0; j < fNSparseBins; j++) 
+            fSparseBackground[j] += par_cts * sparseRow[j];
+      }
+      fBackgroundParValues[k] = par_cts;
+   }
+   fBackgroundValid = true;
+
+   // the cached expectations include the previous background
+   ResetExpectationCache();
+}
+
 double MSModelTHnBMLF::NLogLikelihood(double* par)
+{
+   if (fCompiledNLL && IsCompiled()) return NLogLikelihoodCompiled(par);
+   else                              return NLogLikelihoodTHn(par);
+}
+
+double MSModelTHnBMLF::GetEvaluationCost() const
+{
+   if (fCompiledNLL && IsCompiled()) {
+      const std::size_t nBins = fSparseNLL && fIsSparse ? fNSparseBins : fNBins;
+      return double(nBins) * std::max<std::size_t>(fFreeComponents.size(), 1);
+   } else if (fDataSet != nullptr) {
+      return double(fDataSet->GetNbins()) * std::max<std::size_t>(fParNameList->size(), 1);
+   }
+   return 1.0;
+}
+
+double MSModelTHnBMLF::NLogLikelihoodGradient(double* par, double* grad)
+{
+   if (HasGradient()) return NLogLikelihoodCompiled(par, grad);
+   else               return NLogLikelihood(par);
+}
+
+double MSModelTHnBMLF::NLogLikelihoodCompiled(double* par, double* grad)
+{
+   // retrieve parameters from Minuit
+   if (!IsResolved()) ResolveParameters();
+   for (std::size_t k = 0; k < fNComponents; k++) 
+      fParValues[k] = par[fParIndex[k]];
+   UpdateBackground();
+
+   const bool sparse = UseSparseEvaluation();
+   if (grad == nullptr) return sparse ? NLogLikelihoodSparse() : NLogLikelihoodDense();
+
+   // the derivatives are computed only for the free parameters
+   const double nll = sparse ? NLogLikelihoodSparse(fParGradient.data())
+                             : NLogLikelihoodDense(fParGradient.data());
+   for (const auto& k : fFreeComponents) 
+      grad[fParIndex[k]] += fParGradient[k];
+   return nll;
+}
+
+void MSModelTHnBMLF::NLogLikelihoodHessian(double* par, double* hess)
+{
+   if (!HasHessian()) return;
+
+   // compute the expectation for the current parameters
+   NLogLikelihoodCompiled(par);
+   const bool sparse = UseSparseEvaluation();
+   const std::size_t nBins   = sparse ? fNSparseBins : fNBins;
+   const std::size_t stride  = sparse ? fSparseBinStride : fBinStride;
+   const double* data      = sparse ? fSparseData.data() : fData.data();
+   const double* pdf       = sparse ? fSparseExpectation.data() : fExpectation.data();
+   const double* templates = sparse ? fSparseTemplates->data() : fTemplates->data();
+
+   // d2NLL/dpar_k/dpar_l = exposure^2 * sum_j T_kj * T_lj * d2NLL/dlambda_j^2
+   // The empty bins do not contribute
+   double* weight = fWeight.data();
+   for (std::size_t j = 0; j < nBins; j++) 
+      weight[j] = fExposure * fExposure * D2NLogPoisson(data[j], pdf[j]);
+
+   const std::size_t nPar = fParameters->size();
+   for (std::size_t k = 0; k < fNComponents; k++) {
+      const double* rowK = &templates[k*stride];
+      for (std::size_t l = 0; l <= k; l++) {
+         const double* rowL = &templates[l*stride];
+         double sum = 0.0;
+         for (std::size_t j = 0; j < nBins; j++) sum += rowK[j] * rowL[j] * weight[j];
+         hess[fParIndex[k]*nPar + fParIndex[l]] += sum;
+         if (l != k) hess[fParIndex[l]*nPar + fParIndex[k]] += sum;
+      }
+   }
+}
+
+double MSModelTHnBMLF::NLogLikelihoodEM(double* par, double* logTerm, 
+                                        double* linTerm, double* /*quadTerm*/)
+{
+   if (!HasEMTerms()) return NLogLikelihood(par);
+
+   // compute the expectation for the current parameters
+   const double nll = NLogLikelihoodCompiled(par);
+   const bool sparse = UseSparseEvaluation();
+   const std::size_t nBins   = sparse ? fNSparseBins : fNBins;
+   const std::size_t stride  = sparse ? fSparseBinStride : fBinStride;
+   const double* data      = sparse ? fSparseData.data() : fData.data();
+   const double* pdf       = sparse ? fSparseExpectation.data() : fExpectation.data();
+   const double* templates = sparse ? fSparseTemplates->data() : fTemplates->data();
+
+   // By Jensen's inequality, -n_j*ln(lambda_j) is bounded from above by
+   //    -sum_k n_j*w_kj*ln(x_k), w_kj = exposure*par_k*T_kj/lambda_j
+   // up to a constant, hence the log term of component k is
+   //    par_k * exposure * sum_j T_kj * n_j/lambda_j
+   // The empty bins do not contribute
+   double* weight = fWeight.data();
+   for (std::size_t j = 0; j < nBins; j++) 
+      weight[j] = data[j] != 0 && pdf[j] > 0 ? data[j] / pdf[j] : 0.0;
+
+   for (std::size_t k = 0; k < fNComponents; k++) {
+      const double* row = &templates[k*stride];
+      double sum = 0.0;
+      for (std::size_t j = 0; j < nBins; j++) sum += row[j] * weight[j];
+      logTerm[fParIndex[k]] += fParValues[k] * fExposure * sum;
+      linTerm[fParIndex[k]] += fExposure * fTemplateIntegral[k];
+   }
+   return nll;
+}
+
+double MSModelTHnBMLF::GetSaturatedNLL() const
+{
+   if (fDataSet == nullptr) return 0.0;
+
+   double logLikelihood = 0.0;
+   auto it = fDataSet->CreateIter(kTRUE);
+   Long64_t i = 0;
+   while ((i = it->Next()) >= 0) {
+      const double counts = fDataSet->GetBinContent(i);
+      logLikelihood += MSMath::LogPoisson(counts, counts);
+   }
+   delete it;
+   return -logLikelihood;
+}
+
+void MSModelTHnBMLF::AddLeastSquaresTerms(double* matrix, double* vector)
+{
+   if (!HasLeastSquaresTerms()) return;
+   if (!IsResolved()) ResolveParameters();
+
+   // chi^2 = sum_j w_j * (n_j - exposure * sum_k par_k*T_kj)^2, hence:
+   //    matrix_kl = 2 * exposure^2 * sum_j w_j * T_kj * T_lj
+   //    vector_k  = 2 * exposure   * sum_j w_j * T_kj * n_j
+   // The factor 2 is dropped, as it does not change the solution
+   double* weight = fWeight.data();
+   for (std::size_t j = 0; j < fNBins; j++) 
+      weight[j] = 1.0 / std::max(fData[j], 1.0);
+
+   const std::size_t nPar = fParameters->size();
+   for (std::size_t k = 0; k < fNComponents; k++) {
+      const double* rowK = &(*fTemplates)[k*fBinStride];
+      double sum = 0.0;
+      for (std::size_t j = 0; j < fNBins; j++) sum += rowK[j] * weight[j] * fData[j];
+      vector[fParIndex[k]] += fExposure * sum;
+      for (std::size_t l = 0; l <= k; l++) {
+         const double* rowL = &(*fTemplates)[l*fBinStride];
+         sum = 0.0;
+         for (std::size_t j = 0; j < fNBins; j++) sum += rowK[j] * rowL[j] * weight[j];
+         matrix[fParIndex[k]*nPar + fParIndex[l]] += fExposure * fExposure * sum;
+         if (l != k) matrix[fParIndex[l]*nPar + fParIndex[k]] += fExposure * fExposure * sum;
+      }
+   }
+}
+
+bool MSModelTHnBMLF::IsSparseEvaluationExact() const
+{
+   // the templates are non-negative, hence the expected counts in the empty
+   // bins are non-negative and LogPoisson(0, lambda) = -lambda
+   for (std::size_t k = 0; k < fNComponents; k++) 
+      if (fParValues[k] < 0) return false;
+   return true;
+}
+
+double MSModelTHnBMLF::NLogLikelihoodDense(double* grad)
+{
+   const EvaluationArrays arrays {fNBins, fBinStride, fData.data(), 
+                                  fDataLnGamma.data(), fTemplates->data(), 
+                                  fBackground.data(), fExpectation.data(), 
+                                  &fDenseCache};
+   const double logLikelihood = Evaluate(arrays, nullptr, grad, 0.0);
+
+   // dNLL/dpar_k = exposure * sum_j T_kj * dNLL/dlambda_j
+   if (grad != nullptr) 
+      for (std::size_t k = 0; k < fNComponents; k++) grad[k] *= fExposure;
+   return (-logLikelihood);
+}
+
+double MSModelTHnBMLF::NLogLikelihoodSparse(double* grad)
+{
+   // expected counts in the populated bins
+   const EvaluationArrays arrays {fNSparseBins, fSparseBinStride, 
+                                  fSparseData.data(), fSparseDataLnGamma.data(),
+                                  fSparseTemplates->data(), 
+                                  fSparseBackground.data(),
+                                  fSparseExpectation.data(), &fSparseCache};
+   double populated = 0.0;
+   const double logLikelihoodPopulated = Evaluate(arrays, &populated, grad, -1.0);
+
+   double total = 0.0;
+   for (std::size_t k = 0; k < fNComponents; k++) 
+      total += fParValues[k] * fTemplateIntegral[k];
+
+   // Each empty bin contributes with -lambda: their sum is the total number of
+   // expected counts minus the counts expected in the populated bins
+   const double logLikelihood = 
+      logLikelihoodPopulated - (fExposure*total - populated);
+
+   // The empty bins contribute with exposure * (integral - sum over the
+   // populated bins) to the derivatives, hence:
+   // dNLL/dpar_k = exposure * (I_k + sum_j T_kj * (dNLL/dlambda_j - 1))
+   if (grad != nullptr) 
+      for (std::size_t k = 0; k < fNComponents; k++) 
+         grad[k] = fExposure * (fTemplateIntegral[k] + grad[k]);
+   return (-logLikelihood);
+}
+
+double MSModelTHnBMLF::Evaluate(const EvaluationArrays& arrays, 
+                                double* expected, double* grad, 
+                                double gradOffset)
+{
+   const bool incremental = PrepareExpectationUpdate(*arrays.fCache);
+
+   double logLikelihood = 0.0;
+   if (fThreadPool == nullptr) {
+      EvaluateRange(arrays, incremental, 0, arrays.fNBins, 
+                    logLikelihood, expected, grad, gradOffset);
+   } else {
+      // Split the bins in chunks evaluated in parallel. The partial results
+      // are summed in chunk order, such that the result does not depend on
+      // the number of threads
+      const std::size_t nChunks = (arrays.fNBins + kChunkSize - 1) / kChunkSize;
+      fChunkLogLikelihood.assign(nChunks, 0.0);
+      fChunkExpected.assign(nChunks, 0.0);
+      if (grad != nullptr) fChunkGradient.assign(nChunks*fNComponents, 0.0);
+
+      fThreadPool->ParallelFor(nChunks, [&] (std::size_t c) {
+         const std::size_t first = c * kChunkSize;
+         const std::size_t last  = std::min(first + kChunkSize, arrays.fNBins);
+         EvaluateRange(arrays, incremental, first, last, 
+                       fChunkLogLikelihood[c],
+                       expected != nullptr ? &fChunkExpected[c] : nullptr,
+                       grad != nullptr ? &fChunkGradient[c*fNComponents] : nullptr,
+                       gradOffset);
+      });
+
+      if (expected != nullptr) *expected = 0.0;
+      if (grad != nullptr) std::fill(grad, grad + fNComponents, 0.0);
+      for (std::size_t c = 0; c < nChunks; c++) {
+         logLikelihood += fChunkLogLikelihood[c];
+         if (expected != nullptr) *expected += fChunkExpected[c];
+         if (grad != nullptr) 
+            for (std::size_t k = 0; k < fNComponents; k++) 
+               grad[k] += fChunkGradient[c*fNComponents + k];
+      }
+   }
+
+   FinalizeExpectationUpdate(*arrays.fCache, incremental);
+   return logLikelihood;
+}
+
+void MSModelTHnBMLF::EvaluateRange(const EvaluationArrays& arrays, 
+                                   bool incremental, 
+                                   std::size_t first, std::size_t last,
+                                   double& logLikelihood, double* expected, 
+                                   double* grad, double gradOffset)
+{
+   const std::size_t nBins = last - first;
+   double* pdf = arrays.fExpectation + first;
+
+   if (incremental) {
+      // add the difference of the changed components to the cached expectation
+      for (const auto& k : fFreeComponents) {
+         const double delta = fParDelta[k];
+         if (delta == 0) continue;
+         const double* row = arrays.fTemplates + k*arrays.fStride + first;
+         for (std::size_t j = 0; j < nBins; j++) pdf[j] += delta * row[j];
+      }
+   } else {
+      // build the PDF adding the scaled templates of the free components to
+      // the background of the fixed ones, in the same order used by the 
+      // pdfBuilder, and convert it into expected counts. Without fixed 
+      // components the result does not depend on the evaluation mode
+      const double* background = arrays.fBackground + first;
+      std::copy(background, background + nBins, pdf);
+      for (const auto& k : fFreeComponents) {
+         const double par_cts = fParValues[k];
+         const double* row = arrays.fTemplates + k*arrays.fStride + first;
+         for (std::size_t j = 0; j < nBins; j++) pdf[j] += par_cts * row[j];
+      }
+      for (std::size_t j = 0; j < nBins; j++) pdf[j] *= fExposure;
+   }
+
+   // evaluate the log likelihood with the vectorized kernel
+   const double* data = arrays.fData + first;
+   logLikelihood = 
+      MSMath::SumLogPoisson(data, pdf, arrays.fDataLnGamma + first, nBins);
+
+   if (expected != nullptr) {
+      double sum = 0.0;
+      for (std::size_t j = 0; j < nBins; j++) sum += pdf[j];
+      *expected = sum;
+   }
+
+   // sum_j T_kj * (dNLL/dlambda_j + offset)
+   if (grad != nullptr) {
+      double* weight = fWeight.data() + first;
+      for (std::size_t j = 0; j < nBins; j++) 
+         weight[j] = DNLogPoisson(data[j], pdf[j]) + gradOffset;
+      for (const auto& k : fFreeComponents) {
+         const double* row = arrays.fTemplates + k*arrays.fStride + first;
+         double sum = 0.0;
+         for (std::size_t j = 0; j < nBins; j++) sum += row[j] * weight[j];
+         grad[k] = sum;
+      }
+   }
+}
+
+bool MSModelTHnBMLF::PrepareExpectationUpdate(const ExpectationCache& cache)
+{
+   if (!fIncrementalNLL || !cache.fValid || cache.fExposure != fExposure ||
+       cache.fNUpdates >= kMaxIncrementalUpdates) return false;
+
+   // count the parameters changed since the last evaluation. Non-finite
+   // differences cannot be applied incrementally
+   std::size_t nChanged = 0;
+   for (std::size_t k = 0; k < fNComponents; k++) {
+      const double delta = fParValues[k] - cache.fParValues[k];
+      if (!std::isfinite(delta)) return false;
+      fParDelta[k] = fExposure * delta;
+      if (delta != 0) nChanged++;
+   }
+   return nChanged < fFreeComponents.size();
+}
+
+void MSModelTHnBMLF::FinalizeExpectationUpdate(ExpectationCache& cache, 
+                                               bool incremental)
+{
+   if (!incremental) cache.fNUpdates = 0;
+   else if (cache.fParValues != fParValues) cache.fNUpdates++;
+   cache.fValid = true;
+   cache.fExposure = fExposure;
+   cache.fParValues = fParValues;
+}
+
+double MSModelTHnBMLF::NLogLikelihoodTHn(double* par)
 {
    fPDFBuilder->ResetPDF();
 
    // retrieve parameters from Minuit and compute the total exposure
-   for (int i =0; i < fParNameList->size(); i++) {
-      const double par_cts = GetMinuitParameter(par, fParNameList->at(i));
+   if (!IsResolved()) ResolveParameters();
+   for (std::size_t i =0; i < fParNameList->size(); i++) {
+      const double par_cts = GetMinuitParameter(par, i);
       fPDFBuilder->AddHistToPDF(fParNameList->at(i),  par_cts);
    }
 
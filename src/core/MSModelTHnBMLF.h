@@ -25,6 +25,34 @@
  * pdfBuilder is used within the likelihood function to create the proper PDF. Also
  * the expsoure of the data hist must set
  * 
+ * When both the data set and the pdfBuilder are set, the model is compiled:
+ * the in-range bins of the data set and of each template are flattened into
+ * contiguous aligned arrays (a components-by-bins matrix) and the likelihood
+ * is evaluated directly on them, without building any intermediate THn. The
+ * model must be recompiled (MSModelTHnBMLF::Compile) if the templates are
+ * modified after being attached to the model. When a new data set with the
+ * same in-range bins replaces the previous one (e.g. MC realizations), the
+ * compiled templates are kept and only the data arrays are refreshed, as
+ * long as the histograms of the pdfBuilder are unchanged.
+ *
+ * If less than half of the bins of the data set are populated, the model also
+ * stores a sparse copy of the data (populated bins only, with the constants
+ * ln(Gamma(n+1)) precomputed) and of the templates. The sum of the expected
+ * counts over all bins is then obtained from the template integrals, and the
+ * evaluation scales with the number of populated bins. The sparse evaluation
+ * is used only when it is exactly equivalent to the dense one, i.e. when the
+ * rates are non-negative: the empty bins then contribute -lambda to the log
+ * of the Poisson probability (MSMath::LogPoisson).
+ *
+ * The expected counts are cached together with the parameter values used to
+ * compute them. If only some parameters changed since the last evaluation
+ * (e.g. during the numerical derivatives of Minuit), the cached expectation is
+ * updated by adding the scaled difference of the corresponding templates. A
+ * full rebuild is forced every kMaxIncrementalUpdates updates to bound the 
+ * accumulation of rounding errors.
+ *
+ * If a thread pool is set (MSModel::SetThreadPool), the bins are split in
+ * chunks of kChunkSize bins evaluated in parallel.
  *
  * \author Matteo Agostini
  */
@@ -32,10 +60,15 @@
 #ifndef MST_MSModelTHnBMLF_H
 #define MST_MSModelTHnBMLF_H
 
+// c/c++ libs
+#include <memory>
+#include <vector>
+
 // ROOT libs
 #include <THnBase.h>
 
 // m-stats libs
+#include "MSAlignedAllocator.h"
 #include "MSModel.h"
 #include "MSPDFBuilderTHn.h"
 
@@ -49,9 +82,260 @@ class MSModelTHnBMLF : public MSModelT<THnBase,MSPDFBuilderTHn>
       //! Destructor
       virtual ~MSModelTHnBMLF() {}
 
+      //! Get a copy of the model, including data set, pdf builder and 
+      //! compiled arrays. The template matrices are shared
+      MSModelTHnBMLF* Clone() const override { return new MSModelTHnBMLF(*this); }
+
       //! function returning the negative log likelihood function to be 
       //! minimized (NLL)
       double NLogLikelihood(double* par) override;
+
+      //! Resolve the indexes of the parameters and split the components in
+      //! free and fixed ones. The scaled templates of the fixed components 
+      //! are summed into a background, rebuilt only when their values change
+      void ResolveParameters() override;
+
+      //! Cost of the evaluation: number of evaluated bins times free 
+      //! components
+      double GetEvaluationCost() const override;
+      //! The evaluation on the compiled arrays does not create ROOT objects
+      bool IsThreadSafe() const override { return fCompiledNLL && IsCompiled(); }
+
+      //! The gradient is analytic if the NLL is evaluated on compiled arrays
+      bool HasGradient() const override { return fCompiledNLL && IsCompiled(); }
+      //! NLL and its gradient computed in the same pass over the bins
+      double NLogLikelihoodGradient(double* par, double* grad) override;
+
+      //! The Hessian is analytic if the NLL is evaluated on compiled arrays
+      bool HasHessian() const override { return fCompiledNLL && IsCompiled(); }
+      //! Observed Hessian of the NLL
+      void NLogLikelihoodHessian(double* par, double* hess) override;
+
+      //! The EM terms are available if the templates are non-negative
+      bool HasEMTerms() const override { 
+         return fCompiledNLL && IsCompiled() && fNonNegativeTemplates;
+      }
+      //! NLL and its terms of the EM update (the linear term is the number of
+      //! expected counts per unit rate, the logarithmic one the counts 
+      //! attributed to the component). The terms refer to the exact Poisson
+      //! likelihood, also in the bins where MSMath::LogPoisson uses the 
+      //! Gaussian approximation
+      double NLogLikelihoodEM(double* par, double* logTerm, double* linTerm,
+                              double* quadTerm) override;
+
+      //! NLL of the expectation equal to the counts in each bin (the 
+      //! approximations of MSMath::LogPoisson are applied)
+      double GetSaturatedNLL() const override;
+
+      //! The least squares terms are computed on the compiled arrays
+      bool HasLeastSquaresTerms() const override { return IsCompiled(); }
+      //! Normal equations of the fit of the expected counts to the data set,
+      //! weighting each bin with 1/max(counts,1) (Neyman's chi^2)
+      void AddLeastSquaresTerms(double* matrix, double* vector) override;
+
+      //! Set data set, delete the one previously set and compile the model.
+      //! The compiled templates are reused if possible (see CompileData)
+      void SetDataSet(THnBase* dataSet) override;
+      //! Remove the data set from the model and return it. The model is not
+      //! compiled until a new data set is set, the templates are kept
+      THnBase* ReleaseDataSet() override;
+      //! Set pdf builder, delete the one previously set and compile the model
+      void SetPDFBuilder(MSPDFBuilderTHn* pdf) override;
+
+      //! Flatten data set and templates into contiguous arrays. The function
+      //! is called automatically when the data set or pdf builder are set
+      void Compile();
+      //! Check if the compiled arrays are in sync with the model
+      bool IsCompiled() const {
+         return fIsCompiled && fNComponents == fParNameList->size();
+      }
+      //! Enable/disable the evaluation of the NLL on the compiled arrays
+      void SetCompiledNLL(bool compiled = true) { fCompiledNLL = compiled; }
+      //! Enable/disable the evaluation of the NLL on the populated bins only
+      void SetSparseNLL(bool sparse = true) { fSparseNLL = sparse; }
+      //! Enable/disable the incremental update of the cached expectation
+      void SetIncrementalNLL(bool incremental = true) { 
+         fIncrementalNLL = incremental; ResetExpectationCache();
+      }
+      //! Force a full rebuild of the expectation at the next evaluation
+      void ResetExpectationCache() { 
+         fDenseCache.fValid = false; fSparseCache.fValid = false;
+      }
+
+      //! Maximum number of incremental updates between two full rebuilds of
+      //! the cached expectation
+      static const int kMaxIncrementalUpdates = 64;
+      //! Number of bins evaluated by a task of the thread pool (the arrays of
+      //! a chunk fit in the L2 cache)
+      static const std::size_t kChunkSize = 4096;
+
+   protected:
+      //! NLL computed by building the PDF through the THn's of the pdfBuilder
+      double NLogLikelihoodTHn(double* par);
+      //! NLL computed on the compiled arrays. If grad is not null, the
+      //! gradient is added to it
+      double NLogLikelihoodCompiled(double* par, double* grad = nullptr);
+      //! NLL computed on all in-range bins (fParValues must be set). If 
+      //! grad is not null it is filled with the derivatives with respect to
+      //! the local parameters
+      double NLogLikelihoodDense(double* grad = nullptr);
+      //! NLL computed on the populated bins (fParValues must be set). If 
+      //! grad is not null it is filled with the derivatives with respect to
+      //! the local parameters
+      double NLogLikelihoodSparse(double* grad = nullptr);
+      //! Check if the sparse evaluation is equivalent to the dense one for
+      //! the current values of the parameters, i.e. if all rates are 
+      //! non-negative
+      bool IsSparseEvaluationExact() const;
+      //! Check if the NLL is evaluated on the sparse arrays for the current
+      //! values of the parameters (fParValues must be set)
+      bool UseSparseEvaluation() const {
+         return fSparseNLL && fIsSparse && IsSparseEvaluationExact();
+      }
+      //! Build the sparse arrays from the compiled ones
+      void CompileSparse();
+      //! Refresh the data arrays keeping the compiled templates. Return false
+      //! if the templates cannot be reused, i.e. if the in-range bins of the
+      //! data set or the histograms of the pdfBuilder changed
+      bool CompileData();
+      //! Rebuild the background of the fixed components if their values 
+      //! (fParValues) changed since the last build
+      void UpdateBackground();
+
+      //! Parameter values used to compute a cached expectation
+      struct ExpectationCache {
+         //! Flag set when the cached expectation is in sync with fParValues
+         bool fValid {false};
+         //! Exposure used to compute the cached expectation
+         double fExposure {0.0};
+         //! Values of the parameters used to compute the cached expectation
+         std::vector<double> fParValues;
+         //! Number of incremental updates since the last full rebuild
+         int fNUpdates {0};
+      };
+
+      //! Pointers to the arrays used by the dense or sparse evaluation
+      struct EvaluationArrays {
+         //! Number of bins
+         std::size_t fNBins;
+         //! Length of a row of the template matrix
+         std::size_t fStride;
+         //! Content of the bins of the data set
+         const double* fData;
+         //! ln(Gamma(n+1)) of the bins of the data set
+         const double* fDataLnGamma;
+         //! Template matrix
+         const double* fTemplates;
+         //! Sum of the scaled templates of the fixed components
+         const double* fBackground;
+         //! Buffer storing the expected counts
+         double* fExpectation;
+         //! Parameter values used to compute the expected counts
+         ExpectationCache* fCache;
+      };
+
+      //! Compute the expected counts for fParValues and return the log
+      //! likelihood of the bins. If not null, expected is set to the sum of
+      //! the expected counts and grad to sum_j T_kj * (dNLL/dlambda_j + 
+      //! gradOffset). The bins are split in chunks evaluated in parallel if a
+      //! thread pool is set
+      double Evaluate(const EvaluationArrays& arrays, double* expected, 
+                      double* grad, double gradOffset);
+      //! Same as Evaluate for the bins in [first,last)
+      void EvaluateRange(const EvaluationArrays& arrays, bool incremental,
+                         std::size_t first, std::size_t last, 
+                         double& logLikelihood, double* expected, 
+                         double* grad, double gradOffset);
+      //! Check whether the cached expectation can be updated incrementally
+      //! and compute the differences of the parameters (fParDelta)
+      bool PrepareExpectationUpdate(const ExpectationCache& cache);
+      //! Store the parameter values used to compute the expectation
+      void FinalizeExpectationUpdate(ExpectationCache& cache, bool incremental);
+
+   protected:
+      //! Flag enabling the compiled evaluation of the NLL
+      bool fCompiledNLL {true};
+      //! Flag set when the compiled arrays are ready
+      bool fIsCompiled {false};
+      //! Flag enabling the sparse evaluation of the NLL
+      bool fSparseNLL {true};
+      //! Flag set when the sparse arrays are ready
+      bool fIsSparse {false};
+      //! Flag set when all compiled templates are non-negative
+      bool fNonNegativeTemplates {false};
+      //! Flag enabling the incremental update of the expectation
+      bool fIncrementalNLL {true};
+      //! Number of in-range bins of the data set
+      std::size_t fNBins {0};
+      //! Number of components (rows of the template matrix)
+      std::size_t fNComponents {0};
+      //! Length of a row of the template matrix (fNBins padded to alignment)
+      std::size_t fBinStride {0};
+      //! Global index of the in-range bins in the data set and templates
+      std::vector<Long64_t> fBinIndex;
+      //! Total number of bins of the data set used to compile the templates
+      Long64_t fCompiledNTotalBins {0};
+      //! Version of the histograms of the pdfBuilder used to compile the
+      //! templates (0 if the templates are not compiled)
+      unsigned long fCompiledHistsVersion {0};
+      //! Content of the in-range bins of the data set
+      MSAlignedVector<double> fData;
+      //! ln(Gamma(n+1)) of the in-range bins of the data set
+      MSAlignedVector<double> fDataLnGamma;
+      //! Template matrix: row k stores the template of the k-th local
+      //! parameter of the model (fParNameList order). The matrix is read-only
+      //! and shared with the clones of the model
+      std::shared_ptr<const MSAlignedVector<double>> fTemplates;
+      //! Buffer storing the expected counts during the NLL evaluation
+      MSAlignedVector<double> fExpectation;
+      //! Parameter values used to compute fExpectation
+      ExpectationCache fDenseCache;
+      //! Buffer storing the derivatives of the NLL with respect to the 
+      //! expectation of each bin during the gradient/Hessian evaluation
+      MSAlignedVector<double> fWeight;
+      //! Values of the parameters of the model for the current evaluation
+      std::vector<double> fParValues;
+      //! Derivatives of the NLL with respect to the parameters of the model
+      std::vector<double> fParGradient;
+      //! Change of the parameters since the last evaluation (times exposure)
+      std::vector<double> fParDelta;
+      //! Log likelihood of each chunk of bins (parallel evaluation)
+      std::vector<double> fChunkLogLikelihood;
+      //! Expected counts of each chunk of bins (parallel evaluation)
+      std::vector<double> fChunkExpected;
+      //! Gradient of each chunk of bins (parallel evaluation)
+      std::vector<double> fChunkGradient;
+      //! Integral of each template over the in-range bins
+      std::vector<double> fTemplateIntegral;
+
+      //! Components whose parameter is free (fParNameList order)
+      std::vector<std::size_t> fFreeComponents;
+      //! Components whose parameter is fixed (fParNameList order)
+      std::vector<std::size_t> fFixedComponents;
+      //! Flag set when the background is in sync with the fixed components
+      bool fBackgroundValid {false};
+      //! Values of the parameters used to build the background
+      std::vector<double> fBackgroundParValues;
+      //! Sum of the templates of the fixed components scaled by their value
+      MSAlignedVector<double> fBackground;
+
+      //! Number of populated bins
+      std::size_t fNSparseBins {0};
+      //! Length of a row of the sparse template matrix
+      std::size_t fSparseBinStride {0};
+      //! Content of the populated bins
+      MSAlignedVector<double> fSparseData;
+      //! ln(Gamma(n+1)) of the populated bins
+      MSAlignedVector<double> fSparseDataLnGamma;
+      //! Template matrix restricted to the populated bins (shared with the
+      //! clones of the model)
+      std::shared_ptr<const MSAlignedVector<double>> fSparseTemplates;
+      //! Buffer storing the expected counts in the populated bins
+      MSAlignedVector<double> fSparseExpectation;
+      //! Parameter values used to compute fSparseExpectation
+      ExpectationCache fSparseCache;
+      //! Background of the fixed components in the populated bins
+      MSAlignedVector<double> fSparseBackground;
 };
 
 } // namespace mst
@@ -15,7 +15,11 @@
 // Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 
 // c/c++ libs
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <iostream>
+#include <vector>
 
 // ROOT libgs
 #include <TFile.h>
@@ -30,21 +34,45 @@ namespace mst {
 
 MSPDFBuilderTHn::MSPDFBuilderTHn(const std::string& name): MSObject(name)
 {
-  fHistMap = new HistMap;
+  fHistMap = CreateHistMap();
+  UpdateHistsVersion();
 }
 
-MSPDFBuilderTHn::~MSPDFBuilderTHn()
+MSPDFBuilderTHn::MSPDFBuilderTHn(const MSPDFBuilderTHn& other): 
+   MSObject(other), fHistMap(other.fHistMap), fHistsVersion(other.fHistsVersion),
+   fIntegralMap(other.fIntegralMap)
 {
-   if (fHistMap != nullptr) {
-      for (auto im : *fHistMap) delete im.second;
-      fHistMap->clear();
-      delete fHistMap;
-   }
+  if (other.fTmpPDF) fTmpPDF = (THn*) other.fTmpPDF->Clone();
+  if (other.fRnd)    fRnd    = new MSPhilox(*other.fRnd);
+}
 
+MSPDFBuilderTHn::~MSPDFBuilderTHn()
+{
+   // the histograms are deleted with the last builder sharing them
    delete fTmpPDF;
    delete fRnd;
 }
 
+std::shared_ptr<MSPDFBuilderTHn::HistMap> MSPDFBuilderTHn::CreateHistMap() {
+   return std::shared_ptr<HistMap>(new HistMap, [] (HistMap* histMap) {
+      for (auto im : *histMap) delete im.second;
+      delete histMap;
+   });
+}
+
+void MSPDFBuilderTHn::UpdateHistsVersion() {
+   static std::atomic<unsigned long> lastVersion {0};
+   fHistsVersion = ++lastVersion;
+}
+
+void MSPDFBuilderTHn::DetachHists() {
+   if (fHistMap.use_count() <= 1) return;
+   auto histMap = CreateHistMap();
+   for (const auto& im : *fHistMap) 
+      histMap->insert(HistPair(im.first, (THn*) im.second->Clone()));
+   fHistMap = histMap;
+}
+
 void MSPDFBuilderTHn::LoadHist(const std::string& fileName, 
       const std::string& histName, const std::string& newHistName,
       const Int_t  ndim_pr, const Int_t* dim_pr) {
@@ -54,6 +82,7 @@ void MSPDFBuilderTHn::LoadHist(const std::string& fileName,
     std::cerr << "error: PDF already loaded\n";
     return;
   }
+  DetachHists();
 
   // Get pointer of the file 
   TFile inputFile(fileName.c_str(), "READ");
@@ -95,6 +124,8 @@ void MSPDFBuilderTHn::LoadHist(const std::string& fileName,
         fHistMap->insert( HistPair( newHistName, tmp_pr));
      }
      delete hist;
+     fIntegralMap.erase(newHistName);
+     UpdateHistsVersion();
   }
   
 
@@ -104,6 +135,7 @@ void MSPDFBuilderTHn::LoadHist(const std::string& fileName,
 
 
 void MSPDFBuilderTHn::NormalizeHists(bool respectAxisUserRange) {
+   DetachHists();
    // loop over all hist loaded
    for (auto im : *fHistMap) {
       // loop over dimensions
@@ -113,21 +145,26 @@ void MSPDFBuilderTHn::NormalizeHists(bool respectAxisUserRange) {
       while ((i = it->Next()) >= 0) integral += im.second->GetBinContent(i);
       im.second->Scale(1./integral);
    }
+   fIntegralMap.clear();
+   UpdateHistsVersion();
 }
 
 void MSPDFBuilderTHn::SetRangeUser(double min, double max, int axis) {
+   DetachHists();
    // loop over all hists
    for (auto im : *fHistMap) {
       if (im.second->GetAxis(axis) != nullptr)
          im.second->GetAxis(axis)->SetRangeUser(min,max);
    }
+   fIntegralMap.clear();
+   UpdateHistsVersion();
 }
 
 void MSPDFBuilderTHn::Rebin(Int_t* ngroup) {
    // a hist map is filled and then substitute to the original one
    // because the method THn doesn not provide a method that modyfy the object
-   // itself
-   auto newHistMap = new HistMap;
+   // itself. The old map is deleted if not shared with a copy of the builder
+   auto newHistMap = CreateHistMap();
    for (auto im : *fHistMap) {
       THn* newPdf = im.second->Rebin(ngroup);
       newPdf->SetName(im.second->GetName());
@@ -135,16 +172,37 @@ void MSPDFBuilderTHn::Rebin(Int_t* ngroup) {
       newHistMap->insert( HistPair( newPdf->GetName(), newPdf));
    }
 
-   // Clean up old map 
-   for (auto im : *fHistMap) delete im.second;
-   fHistMap->clear();
-   delete fHistMap;
-
    // swap new map
   fHistMap = newHistMap;
+  fIntegralMap.clear();
+  UpdateHistsVersion();
 }
 
 
+const THn* MSPDFBuilderTHn::GetHist(const std::string& histName) const {
+   HistMap::const_iterator im = fHistMap->find(histName);
+   return im != fHistMap->end() ? im->second : nullptr;
+}
+
+double MSPDFBuilderTHn::GetHistIntegral(const std::string& histName) {
+   std::map<std::string, double>::const_iterator ii = fIntegralMap.find(histName);
+   if (ii != fIntegralMap.end()) return ii->second;
+
+   const THn* hist = GetHist(histName);
+   if (hist == nullptr) {
+      std::cerr << "error: PDF not loaded\n";
+      return 0;
+   }
+   auto it = hist->CreateIter(kTRUE);
+   Long64_t i = 0;
+   double integral = 0;
+   while ((i = it->Next()) >= 0) integral += hist->GetBinContent(i);
+   delete it;
+
+   fIntegralMap[histName] = integral;
+   return integral;
+}
+
 void MSPDFBuilderTHn::AddHistToPDF(const std::string& histName, double scaling) {
    // find hist by name
    HistMap::iterator im = fHistMap->find(histName);
@@ -175,18 +233,130 @@ THn* MSPDFBuilderTHn::GetPDF (const std::string& objName) {
 
 
 THn* MSPDFBuilderTHn::GetMCRealizaton(int ctsNum, bool addPoissonFluctuation) {
-   // set internal random number generator if set
-   TRandom* rndTmpCopy = nullptr;
-   if (fRnd != nullptr)  {
-      rndTmpCopy = gRandom;
-      gRandom = fRnd;
+   if (!fTmpPDF) {
+      std::cerr << "error: PDF not built\n";
+      return nullptr;
    }
 
+   // use the internal random number generator if set. gRandom is not touched
+   TRandom* rnd = fRnd != nullptr ? fRnd : gRandom;
+
    // optinally add Poission fluctuatoins on the number of cts
    if (addPoissonFluctuation) {
-      ctsNum = gRandom->Poisson(ctsNum);
+      ctsNum = rnd->Poisson(ctsNum);
+   }
+
+   THn* realization = CreateRealization(Form("mc_seed_%u",rnd->GetSeed()));
+
+   // Sample the bin of each event from the cumulative distribution of the
+   // PDF, as THn::GetRandom without sub-bin randomization. The sampling is
+   // done on the full range of the histograms in order to preserve the
+   // actual rate
+   std::vector<Long64_t> binIndex;
+   std::vector<double>   cdf;
+   const double integral = CollectRegularBins(binIndex, cdf);
+   if (binIndex.empty()) return realization;
+   for (std::size_t j = 1; j < cdf.size(); j++) cdf[j] += cdf[j-1];
+
+   std::vector<int> counts(binIndex.size(), 0);
+   for ( int i = 0; i < ctsNum; i++ ) {
+      const double u = rnd->Rndm() * integral;
+      const std::size_t j = std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+      counts[std::min(j, counts.size()-1)]++;
    }
+   for (std::size_t j = 0; j < binIndex.size(); j++) 
+      if (counts[j]) realization->SetBinContent(binIndex[j], counts[j]);
+   realization->SetEntries(std::max(ctsNum, 0));
 
+   return realization;
+}
+
+THn* MSPDFBuilderTHn::FillMCRealization(THn* realization, double ctsNum, 
+                                        bool addPoissonFluctuation) {
+   if (!fTmpPDF) {
+      std::cerr << "error: PDF not built\n";
+      return realization;
+   }
+
+   // use the internal random number generator if set. gRandom is not touched
+   TRandom* rnd = fRnd != nullptr ? fRnd : gRandom;
+
+   // reuse the histogram if it has the binning of the PDF
+   const int dim = fTmpPDF->GetNdimensions();
+   bool sameBinning = realization != nullptr && 
+                      realization->GetNdimensions() == dim;
+   for (int i = 0; sameBinning && i < dim; i++) {
+      const TAxis* a = realization->GetAxis(i);
+      const TAxis* b = fTmpPDF->GetAxis(i);
+      sameBinning = a->GetNbins() == b->GetNbins() && 
+                    a->GetXmin()  == b->GetXmin()  && a->GetXmax() == b->GetXmax();
+   }
+   if (!sameBinning) {
+      delete realization;
+      realization = CreateRealization(Form("mc_seed_%u",rnd->GetSeed()));
+   }
+   realization->Reset();
+   for (int i = 0 ; i < dim; i++) 
+      realization->GetAxis(i)->SetRange(fTmpPDF->GetAxis(i)->GetFirst(),
+                                        fTmpPDF->GetAxis(i)->GetLast());
+
+   // The histograms share the binning, hence the global bin indexes
+   std::vector<Long64_t> binIndex;
+   std::vector<double>   binContent;
+   const double integral = CollectRegularBins(binIndex, binContent);
+
+   double entries = 0;
+   if (addPoissonFluctuation) {
+      // independent Poisson counts, i.e. a Poisson number of total counts
+      // split among the bins
+      for (std::size_t j = 0; j < binIndex.size(); j++) {
+         const int n = rnd->Poisson(ctsNum * binContent[j] / integral);
+         if (n) realization->SetBinContent(binIndex[j], n);
+         entries += n;
+      }
+   } else {
+      // multinomial split of the counts: the counts of each bin are binomial
+      // given the counts and the probability left to the remaining bins. The
+      // last bin takes all the counts left, which the rounding of probLeft
+      // could otherwise drop
+      int ctsLeft = int(std::lround(ctsNum));
+      double probLeft = 1.0;
+      for (std::size_t j = 0; j < binIndex.size() && ctsLeft > 0; j++) {
+         const double prob = binContent[j] / integral;
+         const bool last = j+1 == binIndex.size();
+         const int n = !last && prob < probLeft ? 
+                       rnd->Binomial(ctsLeft, prob/probLeft) : ctsLeft;
+         if (n) realization->SetBinContent(binIndex[j], n);
+         entries += n;
+         ctsLeft  -= n;
+         probLeft -= prob;
+      }
+   }
+   realization->SetEntries(entries);
+
+   return realization;
+}
+
+double MSPDFBuilderTHn::CollectRegularBins(std::vector<Long64_t>& binIndex, 
+                                           std::vector<double>& binContent) const {
+   const int dim = fTmpPDF->GetNdimensions();
+   double integral = 0;
+   Int_t coord[dim];
+   for (Long64_t j = 0; j < fTmpPDF->GetNbins(); j++) {
+      const double content = fTmpPDF->GetBinContent(j, coord);
+      if (!(content > 0)) continue;
+      bool regular = true;
+      for (int i = 0; i < dim; i++) 
+         if (coord[i] < 1 || coord[i] > fTmpPDF->GetAxis(i)->GetNbins()) regular = false;
+      if (!regular) continue;
+      binIndex.push_back(j);
+      binContent.push_back(content);
+      integral += content;
+   }
+   return integral;
+}
+
+THn* MSPDFBuilderTHn::CreateRealization(const char* name) const {
    // Build a THn<int> with the same axis of the PDF's
    const int dim = fTmpPDF->GetNdimensions();
    Int_t bin[dim], first[dim], last[dim];
@@ -199,25 +369,10 @@ THn* MSPDFBuilderTHn::GetMCRealizaton(int ctsNum, bool addPoissonFluctuation) {
       max[i]   = fTmpPDF->GetAxis(i)->GetXmax();
    }
 
-   THn* realization = new THnI (Form("mc_seed_%u",gRandom->GetSeed()),
-                                Form("mc_seed_%u",gRandom->GetSeed()),
-                                dim, bin, min, max);
+   THn* realization = new THnI (name, name, dim, bin, min, max);
 
    for (int i = 0 ; i < dim; i++) 
       realization->GetAxis(i)->SetRange(first[i],last[i]);
-
-   // Fill realizations using n-dimensional method
-   // Note that GetRandom works on the full range of the histograms and cannot
-   // be limited to the user range. That's not a problem since the sampling MUST
-   // be done on all histogram range in order to preserve the the actual rate.
-   // Note that over- and under-flow bins are not considered
-   Double_t rndPoint[dim];
-   for ( int j = 0; j < ctsNum; j++ ) {
-      fTmpPDF->GetRandom(rndPoint, kFALSE);
-      realization->Fill(rndPoint);
-   }
-
-   if (rndTmpCopy != nullptr) gRandom = rndTmpCopy;
    return realization;
 }
 
@@ -36,14 +36,16 @@
 // c/c++ libs
 #include <climits>
 #include <map>
+#include <memory>
 #include <string>
+#include <vector>
 
 // ROOT libs
 #include <THn.h>
-#include <TRandom3.h>
 
 // m-stats libs
 #include "MSObject.h"
+#include "MSPhilox.h"
 
 namespace mst {
 
@@ -52,6 +54,11 @@ class MSPDFBuilderTHn : public MSObject
  public:
    //! Constructor
    MSPDFBuilderTHn(const std::string& name = "");
+   //! Copy constructor: the loaded histograms are shared with other and 
+   //! cloned only if one of the two builders modifies them (copy on write)
+   MSPDFBuilderTHn(const MSPDFBuilderTHn& other);
+   //! Assignment operator (disabled)
+   MSPDFBuilderTHn& operator=(const MSPDFBuilderTHn&) = delete;
    //! Destructor
    virtual ~MSPDFBuilderTHn();
 
@@ -79,11 +86,34 @@ class MSPDFBuilderTHn : public MSObject
    //! where the i-th entry is used to rebin the i-th axis
    void Rebin(Int_t* ngroup);
 
+   //! Get pointer to a registered histogram (nullptr if not loaded). The
+   //! builder keeps the ownership of the object
+   const THn* GetHist(const std::string& histName) const;
+
+   //! Get the integral of a registered histogram computed in the user range
+   //! of the axes. Integrals are cached and the cache is cleared whenever the
+   //! histograms are modified by the builder
+   double GetHistIntegral(const std::string& histName);
+
+   //! Get the version of the loaded histograms. A new version is assigned
+   //! whenever the histograms are modified (copies of the builder share it
+   //! while they share the histograms)
+   unsigned long GetHistsVersion() const { return fHistsVersion; }
+
    //! Add scaled histogram to tmp PDF
    void AddHistToPDF(const std::string& histName, double scaling = 1);
 
-   //! Set Seed
-   void SetSeed(unsigned int seed) { delete fRnd; fRnd = new TRandom3(seed); }
+   //! Set the seed of the internal counter-based generator. Builders sharing
+   //! the seed should use different streams (e.g. the index of the data set)
+   //! to produce uncorrelated realizations
+   void SetSeed(unsigned int seed, unsigned int stream = 0) 
+      { delete fRnd; fRnd = new MSPhilox(seed, stream); }
+
+   //! Restart the internal generator from the first number of a realization,
+   //! such that any realization can be regenerated independently of the
+   //! previous ones (requires SetSeed)
+   void SetRealization(unsigned long realization) 
+      { if (fRnd) fRnd->SetRealization(realization); }
 
    //! Reset tmp PDF 
    void ResetPDF() { if (fTmpPDF) fTmpPDF->Reset(); }
@@ -91,14 +121,47 @@ class MSPDFBuilderTHn : public MSObject
    //! Get copy of tmp PDF and reset tmpPDF
    THn* GetPDF (const std::string& objName);
 
-   //! Get MC realizatoin extracted by tmpPDF
+   //! Get MC realizatoin extracted by tmpPDF. The bin of each event is 
+   //! sampled from the cumulative distribution of tmpPDF over its regular
+   //! bins (as THn::GetRandom). gRandom is used only if no seed is set
    THn* GetMCRealizaton(int ctsNum, bool addPoissonFluctuation = false);
 
+   //! Fill an MC realization of tmpPDF with ctsNum expected counts sampling
+   //! the counts of each bin directly: independent Poisson numbers if
+   //! addPoissonFluctuation is set, otherwise a multinomial split of ctsNum
+   //! counts (rounded to the nearest integer). The cost scales with the
+   //! number of bins, not of counts. The content of realization is replaced
+   //! and the histogram is returned. A new histogram is created if 
+   //! realization is null or if its binning does not match tmpPDF (the 
+   //! function takes ownership of realization). gRandom is used only if no
+   //! seed is set
+   THn* FillMCRealization(THn* realization, double ctsNum, 
+                          bool addPoissonFluctuation = false);
+
+ protected:
+   //! Create an empty histogram of integers with the axes of tmpPDF
+   THn* CreateRealization(const char* name) const;
+   //! Collect the global index and content of the populated regular bins of
+   //! tmpPDF over the full range (over- and under-flow bins are not 
+   //! considered). Return the sum of the contents
+   double CollectRegularBins(std::vector<Long64_t>& binIndex, 
+                             std::vector<double>& binContent) const;
+   //! Clone the histograms if they are shared with a copy of the builder
+   void DetachHists();
+   //! Create a new map owning its histograms
+   static std::shared_ptr<HistMap> CreateHistMap();
+   //! Assign a new version to the histograms (unique among all builders)
+   void UpdateHistsVersion();
+
  protected:
-   // Map of histograms
-   HistMap* fHistMap {nullptr};
+   // Map of histograms, shared by the copies of the builder
+   std::shared_ptr<HistMap> fHistMap;
+   // Version of the histograms
+   unsigned long fHistsVersion {0};
+   // Cache of the integrals of the histograms in the user range
+   std::map<std::string, double> fIntegralMap;
    THn*     fTmpPDF  {nullptr};
-   TRandom* fRnd     {nullptr};
+   MSPhilox* fRnd    {nullptr};
 };
 
 } // namespace mst
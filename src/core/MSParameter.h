@@ -93,11 +93,7 @@ class MSParameter : public MSObject
       //! Fix parameter
       void FixTo(double value) { fFixed = true; SetFitStartValue(value, false); }
       //! Release the parameter
-      void Release() { 
-         fFixed = false; 
-         fFitStartValueSet = fFitStartValueSetDefault;
-         fFitStartValue = fFitStartValueDefault;
-      }
+      void Release() { fFixed = false; ResetFitStartValue(); }
       //! Check if the parameter is fixed
       bool IsFixed() const { return fFixed; }
       //! Set gloabal parameter
@@ -147,6 +143,11 @@ class MSParameter : public MSObject
             fFitStartValueDefault = value; 
          }
       }
+      //! Restore the default fit starting value (e.g. after FixTo)
+      void ResetFitStartValue() {
+         fFitStartValueSet = fFitStartValueSetDefault;
+         fFitStartValue = fFitStartValueDefault;
+      }
       //! Check if the fit starting value of the par is set
       inline bool IsFitStartValueSet() const { return fFitStartValueSet; }
       //! Set fit starting value of the parameter
@@ -0,0 +1,96 @@
+// Copyright (C) 2016 Matteo Agostini <matteo.agostini@ph.tum.de>
+
+// This is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+// m-stats libs
+#include "MSPhilox.h"
+
+namespace mst {
+
+namespace {
+// Multipliers and Weyl constants of the key schedule of Philox4x32
+constexpr uint32_t kPhiloxM0 = 0xD2511F53;
+constexpr uint32_t kPhiloxM1 = 0xCD9E8D57;
+constexpr uint32_t kPhiloxW0 = 0x9E3779B9;
+constexpr uint32_t kPhiloxW1 = 0xBB67AE85;
+// 2^-32
+constexpr double kTwoToMinus32 = 2.3283064365386963e-10;
+} // anonymous namespace
+
+MSPhilox::MSPhilox(uint32_t seed, uint32_t stream) : TRandom(seed)
+{
+   SetKey(seed, stream);
+}
+
+void MSPhilox::SetKey(uint32_t seed, uint32_t stream)
+{
+   fSeed = seed;
+   fKey[0] = seed;
+   fKey[1] = stream;
+   SetRealization(0);
+}
+
+void MSPhilox::SetRealization(uint64_t realization)
+{
+   fRealization = realization;
+   fBlock = 0;
+   fPos = 4;
+}
+
+Double_t MSPhilox::Rndm()
+{
+   if (fPos == 4) NextBlock();
+   // the half-integer offset excludes 0 and 1, as for TRandom3
+   return (fBuffer[fPos++] + 0.5) * kTwoToMinus32;
+}
+
+void MSPhilox::RndmArray(Int_t n, Float_t* array)
+{
+   for (Int_t i = 0; i < n; i++) array[i] = Rndm();
+}
+
+void MSPhilox::RndmArray(Int_t n, Double_t* array)
+{
+   for (Int_t i = 0; i < n; i++) array[i] = Rndm();
+}
+
+void MSPhilox::NextBlock()
+{
+   fBuffer[0] = uint32_t(fBlock);
+   fBuffer[1] = uint32_t(fBlock >> 32);
+   fBuffer[2] = uint32_t(fRealization);
+   fBuffer[3] = uint32_t(fRealization >> 32);
+   Philox(fBuffer, fKey);
+   fBlock++;
+   fPos = 0;
+}
+
+void MSPhilox::Philox(uint32_t ctr[4], const uint32_t key[2])
+{
+   uint32_t k0 = key[0], k1 = key[1];
+   for (int round = 0; round < 10; round++) {
+      const uint64_t p0 = uint64_t(kPhiloxM0) * ctr[0];
+      const uint64_t p1 = uint64_t(kPhiloxM1) * ctr[2];
+      const uint32_t c1 = ctr[1], c3 = ctr[3];
+      ctr[0] = uint32_t(p1 >> 32) ^ c1 ^ k0;
+      ctr[1] = uint32_t(p1);
+      ctr[2] = uint32_t(p0 >> 32) ^ c3 ^ k1;
+      ctr[3] = uint32_t(p0);
+      k0 += kPhiloxW0;
+      k1 += kPhiloxW1;
+   }
+}
+
+} // namespace mst
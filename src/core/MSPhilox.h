@@ -0,0 +1,102 @@
+// Copyright (C) 2016 Matteo Agostini <matteo.agostini@ph.tum.de>
+
+// This is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+/*!
+ * \class mst::MSPhilox
+ *
+ * \brief
+ * Counter-based random number generator (Philox4x32-10)
+ *
+ * \details
+ * The n-th number of a stream is a bijective function of a 128-bit counter,
+ * encrypted with ten Philox rounds under a 64-bit key (Salmon et al., SC'11).
+ * The key is built from the seed and a stream index (e.g. the index of the
+ * data set), the upper half of the counter is the index of the realization
+ * and the lower half counts the numbers drawn. Any realization of any stream
+ * can thus be generated independently of the others, on any thread, without
+ * generating the previous ones first.
+ *
+ * The class derives from TRandom, such that all its distributions (Poisson,
+ * Binomial, Gaus, ...) are sampled from the Philox sequence.
+ *
+ * \author Matteo Agostini
+ */
+
+#ifndef MST_MSPhilox_H
+#define MST_MSPhilox_H
+
+// c/c++ libs
+#include <cstdint>
+
+// ROOT libs
+#include <TRandom.h>
+
+namespace mst {
+
+class MSPhilox : public TRandom
+{
+   public:
+      //! Constructor
+      MSPhilox(uint32_t seed = 0, uint32_t stream = 0);
+      //! Destructor
+      virtual ~MSPhilox() {}
+
+      //! Set the key of the generator and restart the first realization
+      void SetKey(uint32_t seed, uint32_t stream);
+      //! Set the seed keeping the stream index (see SetKey). Only the lower
+      //! 32 bits of seed are used
+      virtual void SetSeed(ULong_t seed = 0) { SetKey(seed, GetStream()); }
+      //! Get the stream index
+      uint32_t GetStream() const { return fKey[1]; }
+
+      //! Restart the generator from the first number of a realization
+      void SetRealization(uint64_t realization);
+      //! Get the index of the current realization
+      uint64_t GetRealization() const { return fRealization; }
+
+      //! Uniform number in (0,1). Both signatures are implemented to
+      //! override the function of TRandom with any version of ROOT
+      virtual Double_t Rndm();
+      virtual Double_t Rndm(Int_t) { return Rndm(); }
+      //! Fill an array with uniform numbers in (0,1)
+      virtual void RndmArray(Int_t n, Float_t* array);
+      virtual void RndmArray(Int_t n, Double_t* array);
+
+      //! Encrypt the counter ctr with the key, i.e. the Philox4x32-10 block
+      static void Philox(uint32_t ctr[4], const uint32_t key[2]);
+
+   private:
+      //! Generate the next block of four numbers
+      void NextBlock();
+
+   private:
+      //! Key: seed and stream index
+      uint32_t fKey[2] {0, 0};
+      //! Index of the realization
+      uint64_t fRealization {0};
+      //! Index of the next block within the realization
+      uint64_t fBlock {0};
+      //! Last block of random numbers
+      uint32_t fBuffer[4] {0, 0, 0, 0};
+      //! Position of the next number in the buffer
+      unsigned int fPos {4};
+
+      ClassDef(MSPhilox, 1)
+};
+
+} // namespace mst
+
+#endif // MST_MSPhilox_H
@@ -0,0 +1,127 @@
+// Copyright (C) 2016 Matteo Agostini <matteo.agostini@ph.tum.de>
+
+// This is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+// c/c++ libs
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+// m-stats libs
+#include "MSSobol.h"
+
+namespace mst {
+
+namespace {
+// Initial direction numbers m_1...m_s of the dimensions 2-21 (Joe and Kuo)
+const std::vector<std::vector<uint32_t>> kInitialDirections = {
+   {1},
+   {1, 3},
+   {1, 3, 1},
+   {1, 1, 1},
+   {1, 1, 3, 3},
+   {1, 3, 5, 13},
+   {1, 1, 5, 5, 17},
+   {1, 1, 5, 5, 5},
+   {1, 1, 7, 11, 19},
+   {1, 1, 5, 1, 1},
+   {1, 1, 1, 3, 11},
+   {1, 3, 5, 5, 31},
+   {1, 3, 3, 9, 7, 49},
+   {1, 1, 1, 15, 21, 21},
+   {1, 3, 1, 13, 27, 49},
+   {1, 1, 1, 15, 7, 5},
+   {1, 3, 1, 15, 13, 25},
+   {1, 1, 5, 5, 19, 61},
+   {1, 3, 7, 11, 23, 15, 103},
+   {1, 3, 7, 13, 13, 15, 69}
+};
+
+// Check if the polynomial of degree s over GF(2) (bit i is the coefficient 
+// of x^i) is primitive, i.e. the order of x modulo the polynomial is 2^s-1
+bool IsPrimitive(uint32_t poly, unsigned int s) {
+   const uint32_t period = (1u << s) - 1;
+   uint32_t r = 1;
+   for (uint32_t n = 1; n <= period; n++) {
+      r <<= 1;
+      if (r & (1u << s)) r ^= poly;
+      if (r == 1) return n == period;
+   }
+   return false;
+}
+} // anonymous namespace
+
+MSSobol::MSSobol(unsigned int nDimensions) : fNDimensions(nDimensions)
+{
+   if (nDimensions == 0) {
+      std::cerr << "MSSobol::MSSobol: null number of dimensions" << std::endl;
+      exit(1);
+   }
+
+   fDirection.assign(nDimensions*kNBits, 0);
+   // van der Corput sequence
+   for (unsigned int k = 0; k < kNBits; k++) fDirection[k] = 1u << (kNBits-1-k);
+
+   // The other dimensions use the primitive polynomials sorted by degree s 
+   // and by the inner coefficients a
+   std::mt19937 generator(20160101);
+   unsigned int s = 1;
+   uint32_t a = 0;
+   for (unsigned int d = 1; d < nDimensions; d++) {
+      while (!IsPrimitive((1u << s) | (a << 1) | 1u, s)) {
+         if (++a == (1u << (s-1))) { s++; a = 0; }
+      }
+      uint32_t* v = &fDirection[d*kNBits];
+      for (unsigned int k = 0; k < s && k < kNBits; k++) {
+         uint32_t m = 0;
+         if (d-1 < kInitialDirections.size()) m = kInitialDirections[d-1][k];
+         else m = 2*(generator() % (1u << k)) + 1;
+         v[k] = m << (kNBits-1-k);
+      }
+      for (unsigned int k = s; k < kNBits; k++) {
+         v[k] = v[k-s] ^ (v[k-s] >> s);
+         for (unsigned int j = 1; j < s; j++) 
+            if ((a >> (s-1-j)) & 1u) v[k] ^= v[k-j];
+      }
+      if (++a == (1u << (s-1))) { s++; a = 0; }
+   }
+
+   Reset();
+}
+
+void MSSobol::Reset()
+{
+   fPoint.assign(fNDimensions, 0);
+   fIndex = 0;
+}
+
+void MSSobol::Next(double* x)
+{
+   // Gray code: the next point differs from the current one by the direction
+   // number of the lowest zero bit of the index
+   unsigned int c = 0;
+   while ((fIndex >> c) & 1u) c++;
+   if (c >= kNBits) {
+      std::cerr << "MSSobol::Next: sequence exhausted" << std::endl;
+      exit(1);
+   }
+   fIndex++;
+   for (unsigned int d = 0; d < fNDimensions; d++) {
+      fPoint[d] ^= fDirection[d*kNBits + c];
+      x[d] = fPoint[d] * (1.0/4294967296.0);
+   }
+}
+
+} // namespace mst
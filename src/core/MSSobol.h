@@ -0,0 +1,77 @@
+// Copyright (C) 2016 Matteo Agostini <matteo.agostini@ph.tum.de>
+
+// This is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+/*!
+ * \class mst::MSSobol
+ *
+ * \brief
+ * Generator of the Sobol quasi-random sequence
+ *
+ * \details
+ * Low-discrepancy sequence of points in the unit hypercube, filling it more
+ * uniformly than pseudo-random points (e.g. to choose the start points of
+ * a multi-start fit). The first dimension is the van der Corput sequence in
+ * base 2, the following ones use the primitive polynomials over GF(2) in
+ * increasing order. The initial direction numbers are those of Joe and Kuo
+ * for the first 21 dimensions and random odd integers for the others.
+ * Points are generated in Gray code order.
+ *
+ * \author Matteo Agostini
+ */
+
+#ifndef MST_MSSobol_H
+#define MST_MSSobol_H
+
+// c/c++ libs
+#include <cstdint>
+#include <vector>
+
+namespace mst {
+
+class MSSobol
+{
+   public:
+      //! Constructor
+      MSSobol(unsigned int nDimensions);
+      //! Destructor
+      virtual ~MSSobol() {}
+
+      //! Get the number of dimensions
+      unsigned int GetNDimensions() const { return fNDimensions; }
+
+      //! Fill x with the next point of the sequence (coordinates in [0,1)).
+      //! The origin, first point of the sequence, is skipped
+      void Next(double* x);
+      //! Restart the sequence
+      void Reset();
+
+      //! Number of bits of the direction numbers (maximum 2^32-1 points)
+      static const unsigned int kNBits = 32;
+
+   private:
+      //! Number of dimensions
+      unsigned int fNDimensions {0};
+      //! Direction numbers (kNBits for each dimension)
+      std::vector<uint32_t> fDirection;
+      //! Current point as integers
+      std::vector<uint32_t> fPoint;
+      //! Index of the current point
+      uint32_t fIndex {0};
+};
+
+} // namespace mst
+
+#endif // MST_MSSobol_H
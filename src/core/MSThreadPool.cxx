@@ -0,0 +1,107 @@
+// Copyright (C) 2016 Matteo Agostini <matteo.agostini@ph.tum.de>
+
+// This is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+// m-stats libs
+#include "MSThreadPool.h"
+
+namespace mst {
+
+MSThreadPool::MSThreadPool(unsigned int nThreads)
+{
+   if (nThreads == 0) nThreads = std::thread::hardware_concurrency();
+   for (unsigned int i = 1; i < nThreads; i++)
+      fWorkers.push_back(std::thread(&MSThreadPool::WorkerLoop, this));
+}
+
+MSThreadPool::~MSThreadPool()
+{
+   {
+      std::lock_guard<std::mutex> lock(fMutex);
+      fStop = true;
+   }
+   fWakeUp.notify_all();
+   for (auto& i : fWorkers) i.join();
+}
+
+void MSThreadPool::ParallelFor(std::size_t nTasks, const MSTask& task)
+{
+   if (nTasks == 0) return;
+
+   // run serially if there is nothing to share or the pool is busy
+   if (fWorkers.empty() || nTasks == 1 || !fJobMutex.try_lock()) {
+      for (std::size_t i = 0; i < nTasks; i++) task(i);
+      return;
+   }
+
+   // publish the job and wake up the workers
+   {
+      std::lock_guard<std::mutex> lock(fMutex);
+      fTask = &task;
+      fNextTask = 0;
+      fNTasks = nTasks;
+      fJobID++;
+   }
+   fWakeUp.notify_all();
+
+   // take part to the job
+   RunTasks();
+
+   // close the job, such that workers waking up late do not join it, and wait
+   // for the workers still running a task
+   {
+      std::unique_lock<std::mutex> lock(fMutex);
+      fNTasks = 0;
+      fJobDone.wait(lock, [this] { return fNActiveWorkers == 0; });
+      fTask = nullptr;
+   }
+   fJobMutex.unlock();
+}
+
+void MSThreadPool::WorkerLoop()
+{
+   unsigned long lastJobID = 0;
+   while (true) {
+      {
+         std::unique_lock<std::mutex> lock(fMutex);
+         fWakeUp.wait(lock, [&] { return fStop || fJobID != lastJobID; });
+         if (fStop) return;
+         lastJobID = fJobID;
+         // join the job only if it is still open. Once closed, the calling
+         // thread waits only for the workers that joined it
+         if (fNTasks == 0) continue;
+         fNActiveWorkers++;
+      }
+
+      RunTasks();
+
+      {
+         std::lock_guard<std::mutex> lock(fMutex);
+         fNActiveWorkers--;
+      }
+      fJobDone.notify_all();
+   }
+}
+
+void MSThreadPool::RunTasks()
+{
+   while (true) {
+      const std::size_t i = fNextTask++;
+      if (i >= fNTasks) return;
+      (*fTask)(i);
+   }
+}
+
+} // namespace mst
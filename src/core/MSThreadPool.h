@@ -0,0 +1,109 @@
+// Copyright (C) 2016 Matteo Agostini <matteo.agostini@ph.tum.de>
+
+// This is free software; you can redistribute it and/or modify it under
+// the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation; either version 2.1 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+
+/*!
+ * \class mst::MSThreadPool
+ *
+ * \brief
+ * Persistent pool of worker threads
+ *
+ * \details
+ * The workers are created once and sleep between jobs, such that a job can be
+ * dispatched at the rate at which Minuit calls the likelihood. A job is a set
+ * of independent tasks identified by an index: the tasks are distributed
+ * dynamically among the workers and the calling thread, which takes part to
+ * the job and returns when all tasks are completed.
+ *
+ * Only one job runs at a time. If the pool is busy (e.g. a task submits a
+ * nested job or two threads share the pool) the tasks are executed serially
+ * by the calling thread. The results of a job hence never depend on the
+ * number of threads, as long as the tasks write to separate outputs.
+ *
+ * \author Matteo Agostini
+ */
+
+#ifndef MST_MSThreadPool_H
+#define MST_MSThreadPool_H
+
+// c/c++ libs
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mst {
+
+class MSThreadPool
+{
+   public:
+      //! Type of the function executed by the tasks of a job
+      using MSTask = std::function<void(std::size_t)>;
+
+   public:
+      //! Constructor. The number of threads includes the calling thread
+      //! (0: number of hardware threads)
+      MSThreadPool(unsigned int nThreads = 0);
+      //! Destructor (joins the workers)
+      virtual ~MSThreadPool();
+
+      //! Get the number of threads, including the calling thread
+      unsigned int GetNThreads() const { return fWorkers.size() + 1; }
+
+      //! Run task(i) for i in [0,nTasks) and return when all tasks are done
+      void ParallelFor(std::size_t nTasks, const MSTask& task);
+
+   private:
+      //! Copy constructor (not allowed)
+      MSThreadPool(const MSThreadPool&) = delete;
+      //! Assignment operator (not allowed)
+      MSThreadPool& operator=(const MSThreadPool&) = delete;
+
+      //! Main loop of the workers
+      void WorkerLoop();
+      //! Execute tasks of the current job until none is left
+      void RunTasks();
+
+   private:
+      //! Worker threads
+      std::vector<std::thread> fWorkers;
+      //! Mutex held by the thread running a job
+      std::mutex fJobMutex;
+      //! Mutex protecting the state of the job
+      std::mutex fMutex;
+      //! Condition used to wake up the workers
+      std::condition_variable fWakeUp;
+      //! Condition used to notify the end of the job
+      std::condition_variable fJobDone;
+      //! Task of the current job (does NOT own the object)
+      const MSTask* fTask {nullptr};
+      //! Number of tasks of the current job
+      std::atomic<std::size_t> fNTasks {0};
+      //! Index of the next task to be executed
+      std::atomic<std::size_t> fNextTask {0};
+      //! Counter identifying the current job
+      unsigned long fJobID {0};
+      //! Number of workers running tasks of the current job
+      unsigned int fNActiveWorkers {0};
+      //! Flag stopping the workers
+      bool fStop {false};
+};
+
+} // namespace mst
+
+#endif // MST_MSThreadPool_H
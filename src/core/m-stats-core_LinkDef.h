@@ -9,6 +9,7 @@
 #pragma link C++ class mst::MSDataPoint-!;
 #pragma link C++ class mst::MSDataPointVector-!;
 #pragma link C++ class mst::MSPDFBuilderTHn-!;
+#pragma link C++ class mst::MSPhilox+;
 #pragma link C++ class mst::MSParameter-!;
 #pragma link C++ class mst::MSModel-!;
 #pragma link C++ class mst::MSModelTHnBMLF-!;
@@ -2,11 +2,14 @@
 #define MST_MSHistFit_H
 
 // c/c++ libs
+#include <cmath>
 #include <csignal>
 #include <cstdlib> 
 #include <map>
+#include <set>
 #include <sstream>
 #include <fstream>
+#include <functional>
 
 // ROOT libs
 #include <TBranch.h>
@@ -15,6 +18,7 @@
 #include <TGraph.h>
 #include <TH1D.h>
 #include <THn.h>
+#include <TMath.h>
 #include <TROOT.h>
 #include <TStyle.h>
 #include <TTree.h>
@@ -27,6 +31,7 @@
 #include <MSPDFBuilderTHn.h>
 #include <MSModelTHnBMLF.h>
 #include <MSModelPulls.h>
+#include <MSMath.h>
 #include <MSMinimizer.h>
 
 
@@ -73,6 +78,7 @@ rapidjson::Document LoadConfig (const string& configFileName, bool verbose = fal
          if      (!strcmp (memberType.c_str(), "Bool"  )) c = member.IsBool();  
          else if (!strcmp (memberType.c_str(), "Number")) c = member.IsNumber();
          else if (!strcmp (memberType.c_str(), "Int"   )) c = member.IsInt();   
+         else if (!strcmp (memberType.c_str(), "Uint"  )) c = member.IsUint();  
          else if (!strcmp (memberType.c_str(), "Double")) c = member.IsDouble();
          else if (!strcmp (memberType.c_str(), "String")) c = member.IsString();
          else if (!strcmp (memberType.c_str(), "Array" )) c = member.IsArray(); 
@@ -124,6 +130,8 @@ rapidjson::Document LoadConfig (const string& configFileName, bool verbose = fal
          isMemberCorrect(component.value, "pdf", "Array", "String", 2);        // json/fittingModel/dataSets/*/components/*/pdf[]
          isMemberCorrect(component.value, "injVal", "Number");                 // json/fittingModel/dataSets/*/components/*/injVal
          isMemberCorrect(component.value, "color", "Int");                     // json/fittingModel/dataSets/*/components/*/color
+         if (component.value.HasMember("poi"))                                 // optional field:
+            isMemberCorrect(component.value, "poi", "Bool");                   // json/fittingModel/dataSets/*/components/*/poi
       }                                                                        //
       isMemberCorrect(dataSet.value, "projectOnAxis", "Array", "Int");         // json/fittingModel/dataSets/*/projectOnAxis[]
       isMemberCorrect(dataSet.value, "axis", "Object");                        // json/fittingModel/dataSets/*/axis
@@ -137,6 +145,22 @@ rapidjson::Document LoadConfig (const string& configFileName, bool verbose = fal
          isMemberCorrect(dataSet.value, "normalizePDFInUserRange", "Bool");    // json/fittingModel/dataSets/*/normalizePDFInUserRange
       }                                                                        //
    }                                                                           //
+   if (json["fittingModel"].HasMember("threads"))                              // optional field:
+      isMemberCorrect(json["fittingModel"], "threads", "Uint");                // json/fittingModel/threads
+   if (json["fittingModel"].HasMember("leastSquaresStart"))                    // optional field:
+      isMemberCorrect(json["fittingModel"], "leastSquaresStart", "Bool");      // json/fittingModel/leastSquaresStart
+   if (json["fittingModel"].HasMember("rescaleParameters"))                    // optional field:
+      isMemberCorrect(json["fittingModel"], "rescaleParameters", "Bool");      // json/fittingModel/rescaleParameters
+   if (json["fittingModel"].HasMember("logRates"))                             // optional field:
+      isMemberCorrect(json["fittingModel"], "logRates", "Bool");               // json/fittingModel/logRates
+   if (json["fittingModel"].HasMember("nllOffset"))                            // optional field:
+      isMemberCorrect(json["fittingModel"], "nllOffset", "String");            // json/fittingModel/nllOffset
+   if (json["fittingModel"].HasMember("multiStart"))                           // optional field:
+      isMemberCorrect(json["fittingModel"], "multiStart", "Uint");             // json/fittingModel/multiStart
+   if (json["fittingModel"].HasMember("profileWarmStart"))                     // optional field:
+      isMemberCorrect(json["fittingModel"], "profileWarmStart", "Bool");       // json/fittingModel/profileWarmStart
+   if (json["fittingModel"].HasMember("profileAdaptive"))                      // optional field:
+      isMemberCorrect(json["fittingModel"], "profileAdaptive", "Bool");        // json/fittingModel/profileAdaptive
    if (json.HasMember("pulls")) {                                              // optional block:
       isMemberCorrect(json, "pulls", "Object");                                // json/pulls
       for (const auto& pull : json["pulls"].GetObject()) {                     // json/pulls/*
@@ -156,6 +180,10 @@ rapidjson::Document LoadConfig (const string& configFileName, bool verbose = fal
       isMemberCorrect(step.value, "maxCall", "Number");                        // json/MinimizerSteps/*/maxCall
       isMemberCorrect(step.value, "tollerance", "Number");                     // json/MinimizerSteps/*/tollerance
       isMemberCorrect(step.value, "verbosity", "Int");                         // json/MinimizerSteps/*/verbosity
+      if (step.value.HasMember("analyticCovariance"))                          // optional field:
+         isMemberCorrect(step.value, "analyticCovariance", "Bool");            // json/MinimizerSteps/*/analyticCovariance
+      if (step.value.HasMember("checkCovariance"))                             // optional field:
+         isMemberCorrect(step.value, "checkCovariance", "Bool");               // json/MinimizerSteps/*/checkCovariance
    }                                                                           //
    if (json.HasMember("MC")) {                                                 // optional block:
       isMemberCorrect(json, "MC", "Object");                                   // json/MC
@@ -163,6 +191,8 @@ rapidjson::Document LoadConfig (const string& configFileName, bool verbose = fal
       isMemberCorrect(json["MC"], "seed", "Int");                              // json/MC/seed
       isMemberCorrect(json["MC"], "enablePoissonFluctuations", "Bool");        // json/MC/enablePoissonFluctuations
       isMemberCorrect(json["MC"], "outputFile", "String");                     // json/MC/outputFile
+      if (json["MC"].HasMember("binnedGeneration"))                            // optional field:
+         isMemberCorrect(json["MC"], "binnedGeneration", "Bool");              // json/MC/binnedGeneration
    }
 
    return json;
@@ -178,16 +208,18 @@ MSMinimizer* InitializeAnalysis (const rapidjson::Document& json) {
    MSMinimizer* fitter = new MSMinimizer();
 
    // loop over data sets and for each create the model and PDFBuilder
+   unsigned int dataSetIndex = 0;
    for (const auto& dataSet : json["fittingModel"]["dataSets"].GetObject()) {
 
       // Create a separate pdfBuilder for each model. The pointer of each pdfBuilder 
       // will be associated to the model.
       MSPDFBuilderTHn* pdfBuilder = new MSPDFBuilderTHn(dataSet.name.GetString());
   
-      // Set seed of the random number generator. Note that each PSDBuilder is
-      // initialized with the same seed. This will produce the same data set if
-      // the parameters of the data sets are all exactly the same.
-      if (json.HasMember("MC")) pdfBuilder->SetSeed(json["MC"]["seed"].GetInt());
+      // Set seed of the random number generator. Each PSDBuilder uses the
+      // same seed but a different stream, i.e. the index of the data set, such
+      // that the data sets are uncorrelated
+      if (json.HasMember("MC")) 
+         pdfBuilder->SetSeed(json["MC"]["seed"].GetInt(), dataSetIndex++);
 
       // Prepare variables to project the multidimensional PSD's on a sub
       // set of its axis:
@@ -287,6 +319,8 @@ MSMinimizer* InitializeAnalysis (const rapidjson::Document& json) {
                        component.value["range"].GetArray()[1].GetDouble());
 
          par->SetFixed(component.value["fixed"].GetBool());
+         if (component.value.HasMember("poi") && component.value["poi"].GetBool())
+            par->SetPoi();
          mod->AddParameter(par);
       }
 
@@ -324,6 +358,14 @@ MSMinimizer* InitializeAnalysis (const rapidjson::Document& json) {
       }
    }
 
+   // Optionally evaluate the NLL with a pool of threads
+   if (json["fittingModel"].HasMember("threads"))
+      fitter->SetNThreads(json["fittingModel"]["threads"].GetUint());
+
+   // Optionally repeat the fit from multiple start points
+   if (json["fittingModel"].HasMember("multiStart"))
+      fitter->SetNMultiStarts(json["fittingModel"]["multiStart"].GetUint());
+
    // Sync the parameters. This call is needed to finilize the initializatoin of
    // the minimizer
    fitter->SyncFitParameters();
@@ -362,9 +404,12 @@ bool SetDataSetFromFile (MSMinimizer* fitter, const std::string& fileName) {
 }
 
 /*
- * Create data sets and automatically associate it to the models
+ * Create data sets and automatically associate it to the models. Each data set
+ * is a function of the seed, the data set index and the realization index
+ * only, and can be regenerated independently of the other realizations
  */
-bool SetDataSetFromMC (const rapidjson::Document& json, MSMinimizer* fitter) {
+bool SetDataSetFromMC (const rapidjson::Document& json, MSMinimizer* fitter,
+                       unsigned long realization = 0) {
 
    // loop over the models and create a new data set for each of them
    for (const auto& model: *fitter->GetModels()) {
@@ -376,6 +421,7 @@ bool SetDataSetFromMC (const rapidjson::Document& json, MSMinimizer* fitter) {
       // get the specific pdfBuilder and reset it
       const auto pdfBuilder = mod->GetPDFBuilder();
       pdfBuilder->ResetPDF();
+      pdfBuilder->SetRealization(realization);
 
       // add hists to pdfBuilder with the desired rate and copute the number 
       // of counts to extract to create the data set
@@ -389,8 +435,19 @@ bool SetDataSetFromMC (const rapidjson::Document& json, MSMinimizer* fitter) {
       }
       // register new data set. The previous one is delete inside the model
       // Define whether to add poission fluctuation to the number of events
-      mod->SetDataSet(pdfBuilder->GetMCRealizaton(totalCounts, 
-                      json["MC"]["enablePoissonFluctuations"].GetBool()));
+      // Optionally sample the counts of each bin directly, refilling the
+      // histogram of the previous data set
+      if (json["MC"].HasMember("binnedGeneration") && 
+          json["MC"]["binnedGeneration"].GetBool()) {
+         THnBase* dataSet = mod->ReleaseDataSet();
+         THn* dataHist = dynamic_cast<THn*>(dataSet);
+         if (dataHist == nullptr) delete dataSet;
+         mod->SetDataSet(pdfBuilder->FillMCRealization(dataHist, totalCounts,
+                         json["MC"]["enablePoissonFluctuations"].GetBool()));
+      } else {
+         mod->SetDataSet(pdfBuilder->GetMCRealizaton(totalCounts, 
+                         json["MC"]["enablePoissonFluctuations"].GetBool()));
+      }
    }
    return true;
 }
@@ -400,15 +457,52 @@ bool SetDataSetFromMC (const rapidjson::Document& json, MSMinimizer* fitter) {
  */
 bool Minimize (const rapidjson::Document& json, MSMinimizer* fitter) {
 
-   // Take Minuit calls from config file in the proper order
-   for (const auto& step : json["MinimizerSteps"].GetObject()) {
-      fitter->SetMinuitVerbosity(step.value["verbosity"].GetInt());
-      fitter->Minimize(step.value["method"].GetString(),
-                       step.value["resetMinuit"].GetBool(),
-                       step.value["maxCall"].GetDouble(),
-                       step.value["tollerance"].GetDouble());
+   // Optionally start from the least squares fit of the data sets instead of
+   // the reference values
+   if (json["fittingModel"].HasMember("leastSquaresStart") &&
+       json["fittingModel"]["leastSquaresStart"].GetBool())
+      fitter->SetFitStartValuesFromLeastSquares();
+
+   // Optionally rescale the parameters passed to minuit. The scales are
+   // computed at the start values for the current data set
+   if (json["fittingModel"].HasMember("rescaleParameters")) {
+      const bool logRates = json["fittingModel"].HasMember("logRates") &&
+                            json["fittingModel"]["logRates"].GetBool();
+      fitter->SetParameterScaling(
+            json["fittingModel"]["rescaleParameters"].GetBool(), logRates);
    }
 
+   // Optionally subtract a constant from the NLL ("saturated" or "start").
+   // The reported minimum is still the absolute NLL
+   if (json["fittingModel"].HasMember("nllOffset"))
+      fitter->SetNLLOffset(json["fittingModel"]["nllOffset"].GetString());
+
+   // Take Minuit calls from config file in the proper order
+   auto runSteps = [&json] (MSMinimizer* m) {
+      for (const auto& step : json["MinimizerSteps"].GetObject()) {
+         m->SetMinuitVerbosity(step.value["verbosity"].GetInt());
+         m->Minimize(step.value["method"].GetString(),
+                     step.value["resetMinuit"].GetBool(),
+                     step.value["maxCall"].GetDouble(),
+                     step.value["tollerance"].GetDouble());
+         // Replace the numerical covariance with the analytic one
+         if (step.value.HasMember("analyticCovariance") &&
+             step.value["analyticCovariance"].GetBool() &&
+             !m->ComputeCovariance(true))
+            std::cerr << "MSMinimizer: analytic covariance not loaded, keeping "
+                      << "the covariance of minuit" << std::endl;
+         // Optionally cross-check the errors with minuit's HESSE
+         if (step.value.HasMember("checkCovariance") &&
+             step.value["checkCovariance"].GetBool())
+            m->CheckCovariance();
+      }
+   };
+
+   // With multiple starts, the steps are run on clones of the fitter and the
+   // best minimum is kept
+   if (fitter->GetNMultiStarts() > 1) fitter->MinimizeMultiStart(runSteps);
+   else runSteps(fitter);
+
    if (fitter->GetMinuitStatus()) {
       std::cerr << "MSMinimizer: minuit return status=" << fitter->GetMinuitStatus()
                 << ", indicating problems in the convergence of the fit\n"; 
@@ -516,17 +610,125 @@ TCanvas* GetCanvasFit (const rapidjson::Document& json, const MSMinimizer* fitte
 }
 
 /*
- * Build profile likelihood scan for a specific parameter
+ * Points of the profile likelihood scan of a parameter in one direction
  */
-TGraph* Profile (const rapidjson::Document& json, MSMinimizer* fitter, 
-      const string& parName, const double NLL, const int nPts) {
+struct ProfileScan {
+   vector<double> poiValue;   // values of the parameter of interest
+   vector<double> minNLL;     // minimum of the NLL for each value
+   double absMinNLL;          // absolute minimum of the NLL found
+   double limit;              // crossing of the confidence level (adaptive scan)
+};
+
+/*
+ * Sequence of fits along a path t of the values of some parameters, which are
+ * fixed by the caller before each fit (profile scan or ray of a contour). If
+ * warm, each fit starts from the free parameters of the previous point of the
+ * path, moved along the predicted path of the minimum: the slope dx/dt if
+ * given (e.g. from the covariance) or the secant through the last two points.
+ * If the previous point converged, the SIMPLEX steps are skipped
+ */
+struct WarmStartFit {
+   const rapidjson::Document& json;
+   MSMinimizer* fitter;
+   const string name;                       // prefix of the error messages
+   const vector<mst::MSParameter*> path;    // parameters fixed along the path
+   const bool warm;
+   vector<mst::MSParameter*> parameters;    // all parameters, in map order
+   bool hasNonSimplexStep = false;
+   vector<double> slope;                    // dx/dt (empty if not available)
+   vector<double> prevValue, prevPrevValue; // values at the last two points
+   double prevT = 0.0, prevPrevT = 0.0;
+   bool prevConverged = false;
+
+   WarmStartFit (const rapidjson::Document& json, MSMinimizer* fitter, 
+         const string& name, const vector<mst::MSParameter*>& path, bool warm) :
+      json(json), fitter(fitter), name(name), path(path), warm(warm) {
+      for (auto it : *fitter->GetParameterMap()) parameters.push_back(it.second);
+      for (const auto& step : json["MinimizerSteps"].GetObject()) 
+         if (strcmp(step.value["method"].GetString(), "SIMPLEX")) hasNonSimplexStep = true;
+   }
+
+   // start the path at t from the given values of the parameters
+   void Start (double t, const vector<double>& value, bool converged) {
+      prevValue = value;
+      prevT = t;
+      prevPrevValue.clear();
+      prevConverged = converged;
+   }
+
+   // run the minimizer steps at the point t of the path and return the
+   // minimum of the NLL
+   double Fit (double t) {
+      // predicted start values of the free parameters
+      if (warm && !prevValue.empty()) {
+         const bool secant = slope.empty() && !prevPrevValue.empty() && 
+                             prevT != prevPrevT;
+         for (std::size_t d = 0; d < parameters.size(); d++) {
+            mst::MSParameter* par = parameters[d];
+            if (par->IsFixed()) continue;
+            double value = prevValue[d];
+            if (!slope.empty()) 
+               value += slope[d] * (t - prevT);
+            else if (secant)
+               value += (prevValue[d] - prevPrevValue[d]) / 
+                        (prevT - prevPrevT) * (t - prevT);
+            if (par->IsRangeMinSet()) value = std::max(value, par->GetRangeMin());
+            if (par->IsRangeMaxSet()) value = std::min(value, par->GetRangeMax());
+            par->SetFitStartValue(value, false);
+         }
+      }
+
+      for (const auto& step : json["MinimizerSteps"].GetObject()) {
+         if (warm && prevConverged && hasNonSimplexStep &&
+             !strcmp(step.value["method"].GetString(), "SIMPLEX")) continue;
+         fitter->SetMinuitVerbosity(step.value["verbosity"].GetInt());
+         fitter->Minimize(step.value["method"].GetString(),
+               step.value["resetMinuit"].GetBool(),
+               step.value["maxCall"].GetDouble(),
+               step.value["tollerance"].GetDouble());
+      }
+
+      // check the status of minuit
+      if (fitter->GetMinuitStatus()) {
+         std::cerr << name << " >> error: minuit returned failed status ["
+            << fitter->GetMinuitStatus() << "] while fitting with ";
+         for (std::size_t i = 0; i < path.size(); i++)
+            std::cerr << (i ? " and " : "") << path[i]->GetName();
+         std::cerr << " fixed to ";
+         for (std::size_t i = 0; i < path.size(); i++)
+            std::cerr << (i ? ", " : "") << path[i]->GetFitStartValue();
+         std::cerr << std::endl;
+      } 
+
+      // store the values for the prediction of the next point
+      if (warm) {
+         prevPrevValue.swap(prevValue);
+         prevPrevT = prevT;
+         prevValue.resize(parameters.size());
+         for (std::size_t d = 0; d < parameters.size(); d++)
+            prevValue[d] = parameters[d]->GetFitBestValue();
+         prevT = t;
+         prevConverged = fitter->GetMinuitStatus() == 0;
+      }
+      return fitter->GetMinNLL();
+   }
+};
+
+/*
+ * Scan the profile likelihood of a parameter in one direction (+1 right, -1
+ * left) starting from its best fit value, minNLL being the minimum of the NLL
+ * at the best fit point. The scan to the right includes the best fit value.
+ * If interval is set, only the crossing of the confidence level is searched:
+ * the scan is adaptive, warm started and stops at the crossing
+ */
+ProfileScan ScanProfile (const rapidjson::Document& json, MSMinimizer* fitter, 
+      const string& parName, const double NLL, const int nPts, 
+      const int direction, const double minNLL, const bool interval = false) {
 
    // retrieve parameter of interest (poi) from the fitter
    mst::MSParameter* poi  = fitter->GetParameter(parName.c_str());
-   if (!poi) {
-         std::cerr << "Profile >> error: parameter " << parName << " not found\n";
-         return nullptr;
-   }
+   ProfileScan result;
+   result.limit = std::numeric_limits<double>::quiet_NaN();
 
    // save best fit values to restore the status of the parameters after the
    // scanning
@@ -541,41 +743,47 @@ TGraph* Profile (const rapidjson::Document& json, MSMinimizer* fitter,
       }
    }
 
-   // Initialize output gaph
-   TGraph* gpll = new TGraph();
    // store absolute minimum of the likelihood
-   double absMinNLL = std::numeric_limits<double>::max();
+   double absMinNLL = minNLL;
+
+   // Optionally start each point of the scan from the nuisance parameters of
+   // the previous one (see WarmStartFit), predicted with the regression on
+   // the poi given by the covariance at the best fit point (analytic Hessian)
+   // if available
+   const bool warmStart = interval ||
+                          (json["fittingModel"].HasMember("profileWarmStart") &&
+                           json["fittingModel"]["profileWarmStart"].GetBool());
+   WarmStartFit path(json, fitter, "Profile", {poi}, warmStart);
+   const bool bestFitConverged = fitter->GetMinuitStatus() == 0;
+
+   // Optionally place the points adaptively instead of in fixed steps: the
+   // points are equally spaced in sqrt(2*DeltaNLL), hence dense where the
+   // profile bends, and the crossing of the confidence level (2*DeltaNLL =
+   // NLL) is refined with the Brent's method. The crossings are stored as
+   // lower and upper limits of the fit of the poi
+   const bool adaptive = interval ||
+                         (json["fittingModel"].HasMember("profileAdaptive") &&
+                          json["fittingModel"]["profileAdaptive"].GetBool());
 
    // define auxiliary lambda function for profiling, which has visibility over
-   // all variables defined up to now
-   auto Scan = [&] (double tVal) {
-      if (tVal < poi->GetRangeMin() || tVal > poi->GetRangeMax()) return false;
+   // all variables defined up to now. It returns the minimum of the NLL with
+   // the poi fixed to tVal
+   auto Fit = [&] (double tVal) {
       poi->FixTo(tVal);
-
-      for (const auto& step : json["MinimizerSteps"].GetObject()) {
-         fitter->SetMinuitVerbosity(step.value["verbosity"].GetInt());
-         fitter->Minimize(step.value["method"].GetString(),
-               step.value["resetMinuit"].GetBool(),
-               step.value["maxCall"].GetDouble(),
-               step.value["tollerance"].GetDouble());
-      }
-
+      const double tmpMinNLL = path.Fit(tVal);
 
       // extract temporary best fit value
-      const double tmpMinNLL = fitter->GetMinNLL();
-      gpll->SetPoint(gpll->GetN(), tVal, tmpMinNLL);
+      result.poiValue.push_back(tVal);
+      result.minNLL.push_back(tmpMinNLL);
       // update absolute minimum if needed
       if (tmpMinNLL < absMinNLL) absMinNLL = tmpMinNLL;
+      return tmpMinNLL;
+   };
 
-      // check the status of minuit
-      if (fitter->GetMinuitStatus()) {
-         std::cerr << "Profile >> error: minuit returned failed status ["
-            << fitter->GetMinuitStatus() << "]"
-            << " while fitting with " << parName 
-            << " fixed to " << tVal << std::endl;
-      } 
-      // chek if the exit conditions are met
-      if (tmpMinNLL - absMinNLL <= NLL)  return true;
+   // scan a point with fixed step and check if the exit conditions are met
+   auto Scan = [&] (double tVal) {
+      if (tVal < poi->GetRangeMin() || tVal > poi->GetRangeMax()) return false;
+      if (Fit(tVal) - absMinNLL <= NLL)  return true;
       else return false;
    };
 
@@ -587,19 +795,72 @@ TGraph* Profile (const rapidjson::Document& json, MSMinimizer* fitter,
       const double poiFitBestValueErr = poi->GetFitBestValueErr();
 
       const double step = 2*poiFitBestValueErr / double(nPts);
-      // scan to the right of the min
-      int counter = 0;
-      fitter->SyncFitParameters(true);
-      while (Scan(poiFitBestValue + counter*step) && counter<10*nPts) counter++;
-      // scan to the left of the min starting from -1 to not add again the best fit
-      // value in the TGraph
-      counter = -1;
-      fitter->SyncFitParameters(true);
-      while (Scan(poiFitBestValue + counter*step) && counter<10*nPts) counter--;
 
-      // normilize profile to the absolute minimum found during while profiling
-      for (int i = 0; i < gpll->GetN(); i++ ) {
-         gpll->SetPoint(i, gpll->GetX()[i], (gpll->GetY()[i]-absMinNLL));
+      if (warmStart && fitter->HasHessian() && fitter->ComputeCovariance()) {
+         // regression of the parameters on the poi
+         const TMatrixDSym& cov = fitter->GetCovariance();
+         const std::size_t nPar = path.parameters.size();
+         std::size_t p = 0;
+         while (p < nPar && path.parameters[p] != poi) p++;
+         if (p < nPar && cov(p,p) > 0) {
+            path.slope.resize(nPar);
+            for (std::size_t d = 0; d < nPar; d++) path.slope[d] = cov(d,p)/cov(p,p);
+         }
+      }
+
+      // adaptive scan starting from the best fit value. Return the crossing of
+      // the confidence level, the range boundary if the profile stays below
+      // it, NaN if it is not found
+      auto ScanAdaptive = [&] () {
+         const double level = 0.5*NLL;
+         const double rStep = std::sqrt(2*NLL) / double(nPts);
+         const double rangeMin = poi->GetRangeMin(), rangeMax = poi->GetRangeMax();
+         double crossing = std::numeric_limits<double>::quiet_NaN();
+         double tPrev = poiFitBestValue, dNLLPrev = 0.0;
+         double tStep = direction * rStep * poiFitBestValueErr;
+         for (int i = 0; i < 10*nPts; i++) {
+            const double tVal = std::min(std::max(tPrev + tStep, rangeMin), rangeMax);
+            if (tVal == tPrev) {
+               // range boundary reached below the confidence level
+               if (std::isnan(crossing)) crossing = tVal;
+               break;
+            }
+            const double dNLL = Fit(tVal) - absMinNLL;
+
+            if (std::isnan(crossing) && dNLLPrev < level && dNLL >= level) {
+               auto f = [&] (double t) { return Fit(t) - absMinNLL - level; };
+               crossing = mst::MSMath::FindRoot(f, tPrev, tVal, 
+                     dNLLPrev - level, dNLL - level, 1e-3*poiFitBestValueErr, 20);
+            }
+            if (dNLL > NLL || (interval && !std::isnan(crossing))) break;
+
+            // next step such that sqrt(2*DeltaNLL) increases by rStep, which
+            // is a constant step for a parabolic profile. The change of the
+            // step is limited to a factor 4
+            const double rVal  = std::sqrt(2*std::max(dNLL, 0.0));
+            const double rPrev = std::sqrt(2*std::max(dNLLPrev, 0.0));
+            double newStep = 4*tStep;
+            if (rVal - rPrev > rStep/4) newStep = tStep * rStep / (rVal - rPrev);
+            if (std::fabs(newStep) < std::fabs(tStep)/4) newStep = tStep/4;
+            tPrev = tVal;
+            dNLLPrev = dNLL;
+            tStep = newStep;
+         }
+         return crossing;
+      };
+
+      // the scan starts from the best fit point
+      path.Start(poiFitBestValue, fitBestValue, bestFitConverged);
+      fitter->SyncFitParameters(true);
+      if (adaptive) {
+         if (direction > 0 && !interval) Fit(poiFitBestValue);
+         result.limit = ScanAdaptive();
+      } else {
+         // the scan to the left starts from -1 to not add again the best fit
+         // value
+         int counter = direction > 0 ? 0 : -1;
+         while (Scan(poiFitBestValue + counter*step) && abs(counter)<10*nPts) 
+            counter += direction;
       }
    }
 
@@ -610,11 +871,64 @@ TGraph* Profile (const rapidjson::Document& json, MSMinimizer* fitter,
       for ( auto it : *fitter->GetParameterMap()) {
          it.second->SetFitBestValue(fitBestValue.at(parIndex));
          it.second->SetFitBestValueErr(fitBestValueErr.at(parIndex));
+         // the predicted start values of the warm start are not kept
+         if (warmStart && !it.second->IsFixed()) it.second->ResetFitStartValue();
          parIndex++;
       }
    }
    poi->Release();
 
+   result.absMinNLL = absMinNLL;
+   return result;
+}
+
+/*
+ * Run nTasks independent tasks on the thread pool of the fitter. Each task
+ * runs on a new clone of the fitter, hence the result does not depend on the
+ * number of threads. At most one clone per thread exists at a time. If the
+ * models can't be cloned, the tasks run serially on the fitter
+ */
+void RunOnClones (MSMinimizer* fitter, std::size_t nTasks, 
+      const std::function<void(MSMinimizer*, std::size_t)>& task) {
+
+   MSThreadPool* pool = fitter->GetThreadPool();
+   const std::size_t nConcurrent = pool ? pool->GetNThreads() : 1;
+   for (std::size_t first = 0; first < nTasks; first += nConcurrent) {
+      // the clones are created serially (see MSMinimizer::Clone)
+      const std::size_t n = std::min(nConcurrent, nTasks - first);
+      vector<MSMinimizer*> clones(n, nullptr);
+      bool cloned = true;
+      for (auto& i : clones) if ((i = fitter->Clone()) == nullptr) cloned = false;
+      if (cloned) {
+         auto run = [&] (std::size_t i) { task(clones[i], first + i); };
+         if (pool) pool->ParallelFor(n, run);
+         else      run(0);
+      }
+      for (auto& i : clones) delete i;
+      if (!cloned) {
+         for (std::size_t t = first; t < nTasks; t++) task(fitter, t);
+         break;
+      }
+   }
+}
+
+/*
+ * Build the profile likelihood graph of a parameter from the scans in the two
+ * directions, normalized to the absolute minimum found. The crossings of the
+ * confidence level are stored as limits of the parameter
+ */
+TGraph* BuildProfileGraph (mst::MSParameter* poi, const string& parName,
+      const ProfileScan& right, const ProfileScan& left) {
+
+   const double absMinNLL = std::min(right.absMinNLL, left.absMinNLL);
+   TGraph* gpll = new TGraph();
+   for (const ProfileScan* scan : {&right, &left})
+      for (std::size_t i = 0; i < scan->poiValue.size(); i++)
+         gpll->SetPoint(gpll->GetN(), scan->poiValue[i], scan->minNLL[i]-absMinNLL);
+
+   if (!std::isnan(left.limit))  poi->SetFitLowerLimit(left.limit);
+   if (!std::isnan(right.limit)) poi->SetFitUpperLimit(right.limit);
+
    // Set titles (this must be done after filling the TGraph. Probably it's a
    // bug of ROOT
    gpll->SetName(Form("nll_%s", parName.c_str())); 
@@ -625,11 +939,49 @@ TGraph* Profile (const rapidjson::Document& json, MSMinimizer* fitter,
 }
 
 /*
- * Build Profile for each parameter of the fit
+ * Build profile likelihood scan for a specific parameter
+ */
+TGraph* Profile (const rapidjson::Document& json, MSMinimizer* fitter, 
+      const string& parName, const double NLL, const int nPts) {
+
+   // retrieve parameter of interest (poi) from the fitter
+   mst::MSParameter* poi  = fitter->GetParameter(parName.c_str());
+   if (!poi) {
+         std::cerr << "Profile >> error: parameter " << parName << " not found\n";
+         return nullptr;
+   }
+
+   const double minNLL = fitter->GetMinNLL();
+   const ProfileScan right = ScanProfile(json, fitter, parName, NLL, nPts, +1, minNLL);
+   const ProfileScan left  = ScanProfile(json, fitter, parName, NLL, nPts, -1, minNLL);
+   return BuildProfileGraph(poi, parName, right, left);
+}
+
+/*
+ * Scan the profile of each parameter of the fit. The two directions of each
+ * parameter are scanned concurrently on clones of the fitter, which share the
+ * compiled templates. The scans are returned in the order of the parameter
+ * map, to the right and to the left of each parameter
  */
+vector<ProfileScan> ScanProfiles (const rapidjson::Document& json, 
+      MSMinimizer* fitter, const double NLL, const int nPts) {
+
+   vector<string> parNames;
+   for ( auto it : *fitter->GetParameterMap()) parNames.push_back(it.second->GetName());
+   const double minNLL = fitter->GetMinNLL();
+   vector<ProfileScan> scans(2*parNames.size());
+   RunOnClones(fitter, scans.size(), [&] (MSMinimizer* minimizer, std::size_t s) {
+      scans[s] = ScanProfile(json, minimizer, parNames[s/2], NLL, nPts, 
+                             s%2 ? -1 : +1, minNLL);
+   });
+   return scans;
+}
 
-TCanvas* GetCanvasProfiles (const rapidjson::Document& json, MSMinimizer* fitter, 
-      const double NLL, const int nPts) {
+/*
+ * Build the canvas of the profiles of the parameters of the fit from their
+ * scans (see ScanProfiles)
+ */
+TCanvas* GetCanvasProfiles (MSMinimizer* fitter, const vector<ProfileScan>& scans) {
 
    // retrieve the canvas or initialize it
    delete gROOT->GetListOfCanvases()->FindObject("cPLL");
@@ -637,19 +989,242 @@ TCanvas* GetCanvasProfiles (const rapidjson::Document& json, MSMinimizer* fitter
    TCanvas* cc = new TCanvas("cPLL","profile log likelihoods",
                               400*4, 400*ceil(poiNum/4.0)); 
    cc->Divide(4, ceil(poiNum/4.0));
-   
 
-   int parIndex = 0;
+   // assemble the graphs in the order of the parameter map
+   int p = 0;
    for ( auto it : *fitter->GetParameterMap()) {
-      TGraph* tmp = Profile(json, fitter, it.second->GetName().c_str(), NLL, nPts);
-      cc->cd(parIndex+1);
+      TGraph* tmp = BuildProfileGraph(it.second, it.second->GetName(), 
+                                      scans.at(2*p), scans.at(2*p+1));
+      cc->cd(p+1);
       tmp->Draw("al*");
       cc->Update();
-      parIndex++;
+      p++;
    }
    return cc;
 }
 
+/*
+ * Build Profile for each parameter of the fit
+ */
+TCanvas* GetCanvasProfiles (const rapidjson::Document& json, MSMinimizer* fitter, 
+      const double NLL, const int nPts) {
+   return GetCanvasProfiles(fitter, ScanProfiles(json, fitter, NLL, nPts));
+}
+
+/*
+ * Compute the confidence interval of each free parameter of interest from the
+ * crossings of its profile likelihood with the confidence level (2*DeltaNLL =
+ * NLL). Each endpoint is searched as an independent task on a clone of the
+ * fitter, starting from the best fit. The endpoints are stored as lower and
+ * upper limits of the parameters (NaN if not found)
+ */
+void ComputeIntervals (const rapidjson::Document& json, MSMinimizer* fitter, 
+      const double NLL) {
+
+   vector<string> poiNames;
+   for ( auto it : *fitter->GetParameterMap()) 
+      if (it.second->IsPoi() && !it.second->IsFixed()) 
+         poiNames.push_back(it.second->GetName());
+   if (poiNames.empty()) return;
+
+   // two points per side are enough to bracket the crossing of a parabolic 
+   // profile
+   const double minNLL = fitter->GetMinNLL();
+   vector<double> limits(2*poiNames.size());
+   RunOnClones(fitter, limits.size(), [&] (MSMinimizer* minimizer, std::size_t s) {
+      limits[s] = ScanProfile(json, minimizer, poiNames[s/2], NLL, 2, 
+                              s%2 ? -1 : +1, minNLL, true).limit;
+   });
+
+   for (std::size_t p = 0; p < poiNames.size(); p++) {
+      fitter->GetParameter(poiNames[p])->SetFitUpperLimit(limits[2*p]);
+      fitter->GetParameter(poiNames[p])->SetFitLowerLimit(limits[2*p+1]);
+   }
+}
+
+/*
+ * Find the point of a 2D profile likelihood contour along the ray leaving the
+ * best fit point with the given angle, in the plane of the parameters scaled
+ * by their errors. The free parameters of each fit start from the previous
+ * point of the ray (the best fit point for the first one) and the crossing of
+ * DeltaNLL = level is refined with the Brent's method. If the ray leaves the
+ * range of the parameters below the level, the point on the boundary is
+ * returned. NaN is returned if the crossing is not found
+ */
+std::pair<double,double> FindContourPoint (const rapidjson::Document& json, 
+      MSMinimizer* fitter, const string& parNameX, const string& parNameY, 
+      const double angle, const double level, const double minNLL) {
+
+   mst::MSParameter* parX = fitter->GetParameter(parNameX.c_str());
+   mst::MSParameter* parY = fitter->GetParameter(parNameY.c_str());
+   const double x0 = parX->GetFitBestValue();
+   const double y0 = parY->GetFitBestValue();
+   const double ux = std::cos(angle) * parX->GetFitBestValueErr();
+   const double uy = std::sin(angle) * parY->GetFitBestValueErr();
+
+   // save best fit values to restore the status of the parameters
+   vector<mst::MSParameter*> parameters;
+   vector<double> fitBestValue, fitBestValueErr;
+   for (auto it : *fitter->GetParameterMap()) {
+      parameters.push_back(it.second);
+      fitBestValue.push_back(it.second->GetFitBestValue());
+      fitBestValueErr.push_back(it.second->GetFitBestValueErr());
+   }
+
+   // distance along the ray at which the range of the parameters is left
+   double sMax = std::numeric_limits<double>::infinity();
+   auto LimitRay = [&sMax] (const mst::MSParameter* par, double v0, double u) {
+      if (u > 0 && par->IsRangeMaxSet()) sMax = std::min(sMax, (par->GetRangeMax()-v0)/u);
+      if (u < 0 && par->IsRangeMinSet()) sMax = std::min(sMax, (par->GetRangeMin()-v0)/u);
+   };
+   LimitRay(parX, x0, ux);
+   LimitRay(parY, y0, uy);
+
+   // the fits along the ray start from the best fit point
+   WarmStartFit path(json, fitter, "Contour", {parX, parY}, true);
+   path.Start(0.0, fitBestValue, fitter->GetMinuitStatus() == 0);
+   double absMinNLL = minNLL;
+
+   // fit with the two parameters fixed at distance s along the ray and
+   // return DeltaNLL
+   auto Fit = [&] (double s) {
+      parX->FixTo(x0 + s*ux);
+      parY->FixTo(y0 + s*uy);
+      const double tmpMinNLL = path.Fit(s);
+      absMinNLL = std::min(absMinNLL, tmpMinNLL);
+      return tmpMinNLL - absMinNLL;
+   };
+
+   // Walk along the ray with secant steps in sqrt(2*DeltaNLL), which is
+   // linear in s for a parabolic profile (s=sqrt(2*level) if the parameters
+   // are uncorrelated), until the level is bracketed
+   const double rLevel = std::sqrt(2*level);
+   double s = std::numeric_limits<double>::quiet_NaN();
+   double sPrev = 0.0, rPrev = 0.0, dNLLPrev = 0.0;
+   double sVal = std::min(rLevel, sMax);
+   for (int i = 0; i < 20; i++) {
+      const double dNLL = Fit(sVal);
+      if (dNLL >= level) {
+         auto f = [&] (double t) { return Fit(t) - level; };
+         s = mst::MSMath::FindRoot(f, sPrev, sVal, dNLLPrev - level, dNLL - level, 
+                                   1e-3, 20);
+         break;
+      }
+      if (sVal >= sMax) { s = sMax; break; }
+
+      const double rVal = std::sqrt(2*std::max(dNLL, 0.0));
+      double sNext = 4*sVal;
+      if (rVal > rPrev) sNext = sVal + 1.1*(rLevel - rVal)*(sVal - sPrev)/(rVal - rPrev);
+      sNext = std::min(std::max(sNext, 1.1*sVal), 4*sVal);
+      sPrev = sVal;
+      rPrev = rVal;
+      dNLLPrev = dNLL;
+      sVal = std::min(sNext, sMax);
+   }
+
+   // restore the parameters
+   for (std::size_t d = 0; d < parameters.size(); d++) {
+      parameters[d]->SetFitBestValue(fitBestValue[d]);
+      parameters[d]->SetFitBestValueErr(fitBestValueErr[d]);
+      if (!parameters[d]->IsFixed()) parameters[d]->ResetFitStartValue();
+   }
+   parX->Release();
+   parY->Release();
+
+   return std::make_pair(x0 + s*ux, y0 + s*uy);
+}
+
+/*
+ * Build the 2D profile likelihood contour of two parameters at the confidence
+ * level CL. The contour is traced by rays leaving the best fit point: 8 rays
+ * are equally spaced in the plane of the parameters scaled by their errors,
+ * then rays are added between neighbouring points where the contour bends
+ * (turn larger than 15 deg) or its radius changes by more than 10%, until
+ * nPts points are found. The rays of each iteration run concurrently on
+ * clones of the fitter
+ */
+TGraph* Contour (const rapidjson::Document& json, MSMinimizer* fitter, 
+      const string& parNameX, const string& parNameY, const double CL, 
+      const int nPts) {
+
+   mst::MSParameter* parX = fitter->GetParameter(parNameX.c_str());
+   mst::MSParameter* parY = fitter->GetParameter(parNameY.c_str());
+   if (!parX || !parY) {
+      std::cerr << "Contour >> error: parameter " << (parX ? parNameY : parNameX)
+                << " not found\n";
+      return nullptr;
+   }
+   if (parX->IsFixed() || parY->IsFixed() || 
+       parX->GetFitBestValueErr() <= 0 || parY->GetFitBestValueErr() <= 0) {
+      std::cerr << "Contour >> error: parameters " << parNameX << " and " 
+                << parNameY << " must be free with non-null errors\n";
+      return nullptr;
+   }
+
+   const double level = 0.5*TMath::ChisquareQuantile(CL, 2);
+   const double minNLL = fitter->GetMinNLL();
+   const double x0  = parX->GetFitBestValue();
+   const double y0  = parY->GetFitBestValue();
+   const double sx  = parX->GetFitBestValueErr();
+   const double sy  = parY->GetFitBestValueErr();
+
+   // points of the contour sorted by angle, and angles with no point found
+   // (never requested again)
+   std::map<double, std::pair<double,double>> points;
+   std::set<double> failed;
+   vector<double> angles;
+   for (int k = 0; k < 8; k++) angles.push_back(2*TMath::Pi()*k/8.);
+
+   while (!angles.empty()) {
+      vector<std::pair<double,double>> found(angles.size());
+      RunOnClones(fitter, angles.size(), [&] (MSMinimizer* minimizer, std::size_t k) {
+         found[k] = FindContourPoint(json, minimizer, parNameX, parNameY, 
+                                     angles[k], level, minNLL);
+      });
+      bool added = false;
+      for (std::size_t k = 0; k < angles.size(); k++) {
+         if (std::isnan(found[k].first)) failed.insert(angles[k]);
+         else { points[angles[k]] = found[k]; added = true; }
+      }
+      angles.clear();
+      if (!added || points.size() < 3) break;
+
+      // scaled coordinates of the points
+      vector<double> a, u, v;
+      for (const auto& p : points) {
+         a.push_back(p.first);
+         u.push_back((p.second.first  - x0)/sx);
+         v.push_back((p.second.second - y0)/sy);
+      }
+      const std::size_t n = a.size();
+      // turn of the contour at point i
+      auto Turn = [&] (std::size_t i) {
+         const std::size_t h = (i+n-1)%n, j = (i+1)%n;
+         const double t = std::atan2(v[j]-v[i], u[j]-u[i]) - std::atan2(v[i]-v[h], u[i]-u[h]);
+         return std::fabs(std::remainder(t, 2*TMath::Pi()));
+      };
+      for (std::size_t i = 0; i < n && points.size() + angles.size() < std::size_t(nPts); i++) {
+         const std::size_t j = (i+1)%n;
+         const double ri = std::hypot(u[i], v[i]), rj = std::hypot(u[j], v[j]);
+         const bool bends = std::max(Turn(i), Turn(j)) > TMath::Pi()/12 ||
+                            std::fabs(ri - rj) > 0.1*std::max(ri, rj);
+         const double aj = j ? a[j] : a[j] + 2*TMath::Pi();
+         if (!bends || aj - a[i] <= 1e-3) continue;
+         const double mid = std::fmod(0.5*(a[i] + aj), 2*TMath::Pi());
+         if (!failed.count(mid)) angles.push_back(mid);
+      }
+   }
+
+   TGraph* gcont = new TGraph();
+   for (const auto& p : points) gcont->SetPoint(gcont->GetN(), p.second.first, p.second.second);
+   // close the contour
+   if (gcont->GetN()) gcont->SetPoint(gcont->GetN(), gcont->GetX()[0], gcont->GetY()[0]);
+
+   gcont->SetName(Form("contour_%s_%s", parNameX.c_str(), parNameY.c_str())); 
+   gcont->GetXaxis()->SetTitle(Form("%s rate [cts/100T/d]", parNameX.c_str())); 
+   gcont->GetYaxis()->SetTitle(Form("%s rate [cts/100T/d]", parNameY.c_str())); 
+   return gcont;
+}
 
 } // namespace mst
 
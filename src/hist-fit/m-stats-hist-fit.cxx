@@ -27,12 +27,17 @@
 #define DESCRIPTION "A tool for multi variate binned analysis with THn histograms"
 
 // c/c++ libs
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstdlib>
 #include <getopt.h>
 #include <iostream>
+#include <mutex>
 #include <signal.h>
 #include <sstream>
 #include <string>
+#include <thread>
 
 // ROOT libs
 #include <TApplication.h>
@@ -84,6 +89,13 @@ using namespace std;
    //! approx delta CL to cover in profiles
    double gProfilesCL = 0.95;
 
+   //! number of threads used to evaluate the NLL (-1: use config file)
+   int gNLLThreads = -1;
+   //! number of starts of each fit (-1: use config file)
+   int gMultiStart = -1;
+   //! number of realizations processed in parallel in batch mode (0: all cores)
+   int gBatchThreads = 1;
+
    //! store Data sets in multi-fit operation mode:
    bool gStoreMFDataSets = false;
    //! store canvas with maximum likelihood fit in multi-fit operations
@@ -100,8 +112,11 @@ using namespace std;
  *****************************************************************************/
    //! interrupt variable
    static sig_atomic_t volatile gRunning = true;
+   //! interrupt variable polled by the worker threads (lock-free, hence it
+   //! can be set by the handler)
+   static std::atomic<bool> gWorkersRunning {true};
    //! interrupt handler
-   void sig_handler(int signum) { gRunning = false; }
+   void sig_handler(int signum) { gRunning = false; gWorkersRunning = false; }
 /*****************************************************************************/
 
 
@@ -141,12 +156,15 @@ int main(int argc, char** argv)
       TApplication theApp("App",&argc, argv);
 
       auto fitter = mst::InitializeAnalysis(json);
+      if (gNLLThreads >= 0) fitter->SetNThreads(gNLLThreads);
+      if (gMultiStart >= 0) fitter->SetNMultiStarts(gMultiStart);
       // FIXME: Here load external data set if the name is parsed by command
       // line
       if (gDatafromFile) mst::SetDataSetFromFile(fitter, gInputFileName);
       else mst::SetDataSetFromMC(json, fitter);
 
       mst::Minimize (json,fitter);
+      mst::ComputeIntervals(json, fitter, TMath::ChisquareQuantile(gProfilesCL,1));
 
       // Print parameter summary
       fitter->PrintParSummary();
@@ -167,12 +185,18 @@ int main(int argc, char** argv)
       gROOT->SetBatch();
 
       auto fitter = mst::InitializeAnalysis(json);
+      if (gNLLThreads >= 0) fitter->SetNThreads(gNLLThreads);
+      if (gMultiStart >= 0) fitter->SetNMultiStarts(gMultiStart);
+      const bool multiStart = fitter->GetNMultiStarts() > 1;
 
       // Initialize output variables
       int minuitStatus = 0;
+      int nStartsAgree = 0;
       double absNLLMin = std::numeric_limits<double>::max();
       vector<double> fitBestValue    (fitter->GetParameterMap()->size(), -1);
       vector<double> fitBestValueErr (fitter->GetParameterMap()->size(), -1);
+      vector<double> fitLowerLimit   (fitter->GetParameterMap()->size(), -1);
+      vector<double> fitUpperLimit   (fitter->GetParameterMap()->size(), -1);
       TCanvas* cMLF {nullptr};
       TCanvas* cPLL {nullptr};
 
@@ -192,6 +216,7 @@ int main(int argc, char** argv)
          // Initialize branches 
          otree->Branch("absNLLMin", &absNLLMin);
          otree->Branch("minuitStatus", &minuitStatus);
+         if (multiStart) otree->Branch("nStartsAgree", &nStartsAgree);
          {
             int counter = 0;
             for ( auto it : *fitter->GetParameterMap()) {
@@ -199,6 +224,12 @@ int main(int argc, char** argv)
                      &(fitBestValue.at(counter)));
                otree->Branch(Form("%sErr",it.second->GetName().c_str()), 
                      &(fitBestValueErr.at(counter)));
+               if (it.second->IsPoi()) {
+                  otree->Branch(Form("%sLowerLimit",it.second->GetName().c_str()), 
+                        &(fitLowerLimit.at(counter)));
+                  otree->Branch(Form("%sUpperLimit",it.second->GetName().c_str()), 
+                        &(fitUpperLimit.at(counter)));
+               }
                counter++;
             }
          }
@@ -208,6 +239,7 @@ int main(int argc, char** argv)
       } else {
          otree->SetBranchAddress("minuitStatus", &minuitStatus);
          otree->SetBranchAddress("absNLLMin",    &absNLLMin);
+         if (multiStart) otree->SetBranchAddress("nStartsAgree", &nStartsAgree);
          {
             int counter = 0;
             for ( auto it : *fitter->GetParameterMap()) {
@@ -215,6 +247,12 @@ int main(int argc, char** argv)
                      &(fitBestValue.at(counter)));
                otree->SetBranchAddress(Form("%sErr",it.second->GetName().c_str()), 
                      &(fitBestValueErr.at(counter)));
+               if (it.second->IsPoi()) {
+                  otree->SetBranchAddress(Form("%sLowerLimit",it.second->GetName().c_str()), 
+                        &(fitLowerLimit.at(counter)));
+                  otree->SetBranchAddress(Form("%sUpperLimit",it.second->GetName().c_str()), 
+                        &(fitUpperLimit.at(counter)));
+               }
                counter++;
             }
          }
@@ -222,34 +260,48 @@ int main(int argc, char** argv)
          if (gBuildProfiles)    otree->SetBranchAddress("cPLL", &cPLL);
       }
 
-      // start loop over realizations 
-      // Note: if the input is taken from file, the loop will be broken after
-      // the first iteration
+      // Note: if the input is taken from file, only one realization is
+      // processed
       const int iMax= gDatafromFile ? 1 : json["MC"]["realizations"].GetDouble();
-      for (int i=0; i< iMax; i++) {
-         if (!gDatafromFile) 
-            cout << "# processing MC realization " << i+1 << " of " << iMax << endl;
-
-         // Check for interrupts 
-         signal(SIGINT,  &sig_handler);
-         signal(SIGTERM, &sig_handler);
-         if (!gRunning) break;
-
-         if (gDatafromFile) mst::SetDataSetFromFile(fitter, gInputFileName); 
-         else mst::SetDataSetFromMC(json, fitter);
-         mst::Minimize(json, fitter);
 
+      // Check for interrupts 
+      signal(SIGINT,  &sig_handler);
+      signal(SIGTERM, &sig_handler);
+
+      // Generate and fit the i-th realization. Minuit is reinitialized, such
+      // that the fit does not depend on the realizations previously processed
+      // by the same fitter. The profile scans are returned if requested
+      auto fitRealization = [&] (mst::MSMinimizer* f, int i) {
+         f->InitializeMinuit();
+         if (gDatafromFile) mst::SetDataSetFromFile(f, gInputFileName); 
+         else mst::SetDataSetFromMC(json, f, i);
+         mst::Minimize(json, f);
+         mst::ComputeIntervals(json, f, TMath::ChisquareQuantile(gProfilesCL, 1));
+         vector<mst::ProfileScan> scans;
+         if (gBuildProfiles) scans = mst::ScanProfiles(json, f, 
+                                        TMath::ChisquareQuantile(gProfilesCL, 1),
+                                        gProfilePts);
+         return scans;
+      };
+
+      // Fill the tree with the results of the i-th realization and optionally 
+      // store canvases and data sets. Called in the order of the realizations
+      auto storeRealization = [&] (mst::MSMinimizer* fitter, int i,
+                                   const vector<mst::ProfileScan>& scans) {
          { // transfer output values to the vectors associated to the tree
             int counter = 0;
             for ( auto it : *fitter->GetParameterMap()) {
                fitBestValue.at(counter)    = it.second->GetFitBestValue();
                fitBestValueErr.at(counter) = it.second->GetFitBestValueErr();
+               fitLowerLimit.at(counter)   = it.second->GetFitLowerLimit();
+               fitUpperLimit.at(counter)   = it.second->GetFitUpperLimit();
                counter++;
             }
          }
 
          minuitStatus = fitter->GetMinuitStatus();
          absNLLMin = fitter->GetMinNLL();
+         if (multiStart) nStartsAgree = fitter->GetNStartsAgree();
 
          if (gVerbosityLevel) {
             fitter->PrintParSummary();
@@ -257,9 +309,7 @@ int main(int argc, char** argv)
          }
 
          if (gStoreMFCanvasMLF) cMLF = mst::GetCanvasFit(json, fitter);
-         if (gBuildProfiles)    cPLL = mst::GetCanvasProfiles(json, fitter,
-                                            TMath::ChisquareQuantile(gProfilesCL, 1),
-                                            gProfilePts);
+         if (gBuildProfiles)    cPLL = mst::GetCanvasProfiles(fitter, scans);
 
          otree->Fill();
 
@@ -284,7 +334,74 @@ int main(int argc, char** argv)
             }
             tmpFile.Close();
          }
+      };
+
+      // Each worker processes the realizations on its own clone of the fitter,
+      // using the same number of threads to evaluate the NLL. The pdfBuilders
+      // of the clones share the histograms of the templates. The data sets
+      // depend only on the realization index
+      const int nCores = std::thread::hardware_concurrency();
+      const int nWorkers = std::min(gBatchThreads > 0 ? gBatchThreads : nCores, iMax);
+      vector<mst::MSMinimizer*> workers;
+      if (nWorkers > 1) {
+         ROOT::EnableThreadSafety();
+         for (int w = 0; w < nWorkers; w++) {
+            mst::MSMinimizer* worker = fitter->Clone();
+            if (worker == nullptr) break;
+            worker->SetNThreads(fitter->GetNThreads());
+            worker->SetNMultiStarts(fitter->GetNMultiStarts());
+            worker->SyncFitParameters();
+            workers.push_back(worker);
+         }
+         if (int(workers.size()) != nWorkers) {
+            cout << "warning: models not supporting clones, "
+                 << "realizations processed serially" << endl;
+            for (auto w : workers) delete w;
+            workers.clear();
+         }
+      }
+
+      if (workers.empty()) {
+         // start loop over realizations 
+         for (int i=0; i< iMax && gRunning; i++) {
+            if (!gDatafromFile) 
+               cout << "# processing MC realization " << i+1 << " of " << iMax << endl;
+            storeRealization(fitter, i, fitRealization(fitter, i));
+         }
+      } else {
+         // The realizations are handed out in order. Once fitted (including
+         // the profile scans), each worker waits for the previous realizations
+         // to be stored, such that the tree is filled as in a serial run. An
+         // interrupt stops the workers from starting new realizations
+         std::atomic<int> nextToFit {0};
+         int nextToStore = 0;
+         std::mutex storeMutex;
+         std::condition_variable storeTurn;
+
+         auto work = [&] (mst::MSMinimizer* worker) {
+            while (gWorkersRunning) {
+               const int i = nextToFit++;
+               if (i >= iMax) return;
+               {
+                  std::lock_guard<std::mutex> lock(storeMutex);
+                  cout << "# processing MC realization " << i+1 << " of " << iMax << endl;
+               }
+               const vector<mst::ProfileScan> scans = fitRealization(worker, i);
+
+               std::unique_lock<std::mutex> lock(storeMutex);
+               storeTurn.wait(lock, [&] { return nextToStore == i; });
+               storeRealization(worker, i, scans);
+               nextToStore++;
+               storeTurn.notify_all();
+            }
+         };
+
+         vector<std::thread> threads;
+         for (auto w : workers) threads.push_back(std::thread(work, w));
+         for (auto& t : threads) t.join();
+         for (auto w : workers) delete w;
       }
+
       ofile.cd();
       otree->Write("", TObject::kOverwrite);
       ofile.Close();
@@ -309,6 +426,10 @@ static struct option long_options[] =
    {"profile-Npts",      required_argument, 0,             'n' },
    {"profile-CL",        required_argument, 0,             'c' },
 
+   {"nll-threads",       required_argument, 0,             'j' },
+   {"multi-start",       required_argument, 0,             'M' },
+   {"threads",           required_argument, 0,             'T' },
+
    {"store-data-set",    no_argument,       0,             'd' },
    {"store-MLF-plot",    no_argument,       0,             't' },
    {"append-to-file",    no_argument,       0,             'a' },
@@ -329,7 +450,7 @@ int process_arguments(int argc, char** argv)
    int operationModeCheck = 0;
    int c;
 
-   while ((c = getopt_long (argc, argv, "ib f:o: pn:c: dta hvV0",
+   while ((c = getopt_long (argc, argv, "ib f:o: pn:c: j:M:T: dta hvV0",
              long_options, NULL)) != -1 ) {
 
       switch (c) {
@@ -363,6 +484,19 @@ int process_arguments(int argc, char** argv)
             conversion >> gProfilesCL; }
             break;
 
+         case 'j':
+            { std::stringstream conversion; conversion << optarg;
+            conversion >> gNLLThreads; }
+            break;
+         case 'M':
+            { std::stringstream conversion; conversion << optarg;
+            conversion >> gMultiStart; }
+            break;
+         case 'T':
+            { std::stringstream conversion; conversion << optarg;
+            conversion >> gBatchThreads; }
+            break;
+
          case 'd': 
             gStoreMFDataSets = true;
             break;
@@ -435,6 +569,18 @@ void usage()
 	      << "  -n, --profile-Npts              approx number of pts in profile" << endl
 	      << endl     
 	      << "  -n, --profile-CL                approx CL interval to be covered" << endl
+	      << "                                  (and CL of the intervals of the poi's)" << endl
+	      << endl 
+	      << "  -j, --nll-threads [N]           threads used to evaluate the likelihood" << endl
+	      << "                                  [default: fittingModel/threads or 1, 0: all cores]" << endl
+	      << endl 
+	      << "  -M, --multi-start [N]           repeat each fit from N start points and keep the best" << endl
+	      << "                                  [default: fittingModel/multiStart or 1]" << endl
+	      << endl 
+	      << "  -T, --threads [N]               realizations generated and fitted in parallel" << endl
+	      << "                                  in batch mode, each with its own fitter and" << endl
+	      << "                                  its own nll-threads" << endl
+	      << "                                  [default: 1, 0: all cores]" << endl
 	      << endl 
 	      << endl 
 	      << "  -d, --store-MC-datasets         store MC generated data sets" << endl